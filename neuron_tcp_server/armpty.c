@@ -18,9 +18,15 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <string.h>
 #include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 
 #include "armspi.h"
+#include "armpty.h"
+#include "armrtu.h"
 
 /* missing c_lflag.
 *    Required to set this termios together with packet mode
@@ -31,6 +37,15 @@
 #define IEXTPROC  EXTPROC
 
 
+/* Board signals received chars and input changes by interrupt */
+void armpty_enable_int(arm_handle* arm)
+{
+    uint16_t interrupt_mask = ARM_INT_MASK;
+    if ((arm->bv.sw_version) && (arm->bv.int_mask_register>0))
+        write_regs(arm, arm->bv.int_mask_register, 1, &interrupt_mask);
+        //printf("int mask : reg=%d mask=%x\n" , arm->bv.int_mask_register, interrupt_mask);
+}
+
 int armpty_open(arm_handle* arm, uint8_t uart)
 {
     static extcomm_counter = 0;
@@ -70,6 +85,7 @@ int armpty_open(arm_handle* arm, uint8_t uart)
         close(masterfd);
         return -1;
     }
+    arm->uart_q[uart].line = extcomm_counter;
     extcomm_counter++;
 
     sprintf(tmp, "%s/%d", dirname, circuit+1);
@@ -126,10 +142,7 @@ int armpty_open(arm_handle* arm, uint8_t uart)
         return -1;
     }
     arm->uart_q[uart].masterpty = masterfd;
-    uint16_t interrupt_mask = 5;
-    if ((arm->bv.sw_version) && (arm->bv.int_mask_register>0))
-        write_regs(arm, arm->bv.int_mask_register, 1, &interrupt_mask);
-        //printf("int mask : reg=%d mask=%x\n" , arm->bv.int_mask_register, interrupt_mask);
+    armpty_enable_int(arm);
     return masterfd;
 }
 
@@ -146,6 +159,27 @@ void dpr(uint8_t* buffer, int len, const char* msg)
 
 
 
+/* Set baudrate of uart without pty (used by gateway) */
+int armpty_setbaud(arm_handle* arm, uint8_t uart, int baud)
+{
+    uint16_t conf[2];
+
+    switch (baud) {
+    case 1200:   conf[0] = B1200;   break;
+    case 2400:   conf[0] = B2400;   break;
+    case 4800:   conf[0] = B4800;   break;
+    case 9600:   conf[0] = B9600;   break;
+    case 19200:  conf[0] = B19200;  break;
+    case 38400:  conf[0] = B38400;  break;
+    case 57600:  conf[0] = B57600;  break;
+    case 115200: conf[0] = B115200; break;
+    default:
+        return -1;
+    }
+    conf[1] = 0x0000; // RTU ?
+    return write_regs(arm, 100+2*uart, 1, conf);
+}
+
 int armpty_setuart(int masterfd, arm_handle* arm, uint8_t uart)
 {
     struct termios tc;
@@ -179,71 +213,287 @@ int armpty_setuart(int masterfd, arm_handle* arm, uint8_t uart)
 }
 
 
+void (*armpty_tx_hook)(arm_handle* arm, uint8_t uart, int wait) = NULL;
+
+static void armpty_settimer(arm_handle* arm, uint32_t usec);
+
+/* Send chars collected in txbuf to uart.
+   Returns count of chars still waiting (remote queue is full) */
+static int armpty_flushtx(arm_handle* arm, uint8_t uart)
+{
+    uart_queue* queue = &arm->uart_q[uart];
+    int n;
+
+    if (queue->txlen == 0) return 0;
+    if (queue->txlen == 1) {
+        n = write_char(arm, uart, queue->txbuf[0]);
+    } else {
+        n = write_string(arm, uart, queue->txbuf, queue->txlen);
+        // board replies count of accepted chars; keep the rest for next round
+        if ((n >= 0) && (n < queue->txlen)) {
+            memmove(queue->txbuf, queue->txbuf + n, queue->txlen - n);
+            queue->txlen -= n;
+            return queue->txlen;
+        }
+    }
+    if (n < 0) {
+        if (arm_verbose) printf("Board%d UART%d lost %d chars\n", arm->index, uart, queue->txlen);
+        queue->overflow++;
+    }
+    queue->txlen = 0;
+    if (queue->txwait) {
+        queue->txwait = 0;
+        if (armpty_tx_hook) armpty_tx_hook(arm, uart, 0);
+    }
+    return 0;
+}
+
+/* Board has not taken all chars. Input of uart is not read until the rest
+   is sent by poll timer or interrupt, so the loop does not spin on it */
+static void armpty_txwait(arm_handle* arm, uint8_t uart)
+{
+    uart_queue* queue = &arm->uart_q[uart];
+    if (queue->txwait) return;
+    queue->txwait = 1;
+    if (armpty_tx_hook) armpty_tx_hook(arm, uart, 1);
+    if (arm->fdint >= 0) {
+        if (arm->polltimer >= 0) armpty_settimer(arm, ARMPTY_POLL_MIN);
+    } else {
+        armpty_poll_kick(arm);
+    }
+}
+
+/* Read fd until EAGAIN and pack data into maximal frames.
+   Pty in packet mode prefixes every read with control byte */
+static int armpty_drain(int fd, arm_handle* arm, uint8_t uart, int pkt)
+{
+    uart_queue* queue = &arm->uart_q[uart];
+    uint8_t buffer[SPI_STR_MAX+1];
+    int rd;
+
+    // leave data in fd while the board has not accepted previous chars
+    if (armpty_flushtx(arm, uart) > 0) {
+        armpty_txwait(arm, uart);
+        return 0;
+    }
+
+    while (1) {
+        rd = read(fd, buffer, pkt + SPI_STR_MAX - queue->txlen);
+        if (rd == 0) {                       // end of file (socket only)
+            armpty_flushtx(arm, uart);
+            return -1;
+        }
+        if (rd < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;   // fd is empty
+            armpty_flushtx(arm, uart);
+            return -1;
+        }
+        //if (rd >1)
+        //    dpr(buffer+1, rd-1, "WR: ");
+        if (pkt && ((buffer[0] != TIOCPKT_DATA) || (rd < 2))) continue;   // control packet
+        memcpy(queue->txbuf + queue->txlen, buffer + pkt, rd - pkt);
+        queue->txlen += rd - pkt;
+        if (queue->txlen == SPI_STR_MAX) {
+            if (armpty_flushtx(arm, uart) > 0) {
+                armpty_txwait(arm, uart);
+                return 0;
+            }
+        }
+    }
+    if (armpty_flushtx(arm, uart) > 0) armpty_txwait(arm, uart);
+    return 0;
+}
+
 int armpty_readpty(int masterfd, arm_handle* arm, uint8_t uart)
 {
-    uint8_t buffer[256+1];
-    // ToDo while ... EAGAIN
-    int rd = read(masterfd, buffer, sizeof(buffer));
-    //if (rd >1)
-    //    dpr(buffer+1, rd-1, "WR: ");
+    armpty_drain(masterfd, arm, uart, 1);
+    armpty_poll_kick(arm);
+    return 0;
+}
+
+/* Raw tcp client connected directly to uart. Returns -1 if client has gone */
+int armpty_readsock(int sockfd, arm_handle* arm, uint8_t uart)
+{
+    armpty_poll_kick(arm);
+    return armpty_drain(sockfd, arm, uart, 0);
+}
 
-    if (rd > 2) {
-        write_string(arm, uart, buffer + 1, rd - 1);
-    } else if (rd > 1) {
-        write_char(arm, uart, buffer[1]);
+/* Move chars from uart ring to pty (or raw tcp client) without intermediate copy.
+   Returns count of chars written, chars rejected by pty stay in ring */
+static int armpty_writepty(arm_handle* arm, uint8_t uart)
+{
+    uart_queue* queue = &arm->uart_q[uart];
+    uint8_t* data;
+    int len, nw;
+    int total = 0;
+
+    if (queue->gateway != NULL) {
+        total = uq_used(queue);
+        rtu_receive(queue->gateway);
+        return total - uq_used(queue);
+    }
+    if ((queue->masterpty == -1) && (queue->sockfd == -1)) {
+        uq_consume(queue, uq_used(queue));
+        return 0;
     }
+    while ((len = uq_peek(queue, &data)) > 0) {
+        //dpr(data, len, "RD: ");
+        if (queue->sockfd != -1) {
+            nw = send(queue->sockfd, data, len, MSG_NOSIGNAL);
+        } else {
+            nw = write(queue->masterpty, data, len);
+        }
+        if (nw <= 0) {
+            if (arm_verbose && (errno != EAGAIN)) printf("wr: uart=%d len=%d err=%d\n", uart, len, errno);
+            break;
+        }
+        uq_consume(queue, nw);
+        total += nw;
+        if (nw < len) break;                 // pty is full
+    }
+    return total;
 }
 
-int armpty_readuart(arm_handle* arm, int do_idle)
+static void armpty_readchannel(arm_handle* arm, uint8_t uart)
 {
-    /* ... ToDo more uarts ...  */
-    uint8_t uart = 0;
-    uint8_t buffer[256];
+    uart_queue* queue = &arm->uart_q[uart];
     int n;
-    int wanted = sizeof(buffer);
-    int nr = 0;
     int tries = 3;
 
-    if (do_idle) idle_op(arm);
-    while ((n = arm->uart_q[uart].remain) > 0) {
-        if (n > wanted) n = wanted;
-        n = read_string(arm, uart, buffer + nr, n);
+    /* Only uart 0 gets remote queue length from char replies,
+       other channels must be probed by read_string */
+    if ((uart > 0) && (queue->remain == 0)) {
+        fetch_string(arm, uart, SPI_STR_MAX);
+    }
+    while ((n = queue->remain) > 0) {
+        if (uq_free(queue) < 2) {
+            // ring is full, make place or leave rest in remote queue
+            if (armpty_writepty(arm, uart) == 0) break;
+            continue;
+        }
+        n = fetch_string(arm, uart, n);
         if (n < 0) {
             if (--tries) continue;
             break;
         }
         tries = 3;
-        wanted -= n; 
-        nr += n;
-        if (wanted == 0) {
-            if ((arm->uart_q[uart].masterpty != -1)) {
-                //dpr(buffer, nr, "RD: ");
-                int nw = write(arm->uart_q[uart].masterpty, buffer, nr);
-                if (nr != nw ) 
-                    { if (arm_verbose) printf("1 wr: nr=%d nw=%d\n", nr,nw); }
-            }
-            nr = 0;
-            wanted = sizeof(buffer);
-        }
     }
-    n = read_qstring(arm, uart, buffer + nr, wanted);
-    nr += n;
-    if (nr > 0) {
-        if ((arm->uart_q[uart].masterpty != -1)) {
-            //dpr(buffer, nr, "RD: ");
-            int nw = write(arm->uart_q[uart].masterpty, buffer, nr);
-            if (nr != nw )
-                { if (arm_verbose) printf("2 wr: nr=%d nw=%d\n", nr,nw); }
-        }
-        nr = 0;
-    }
-    if (n == wanted) {
-        n = read_qstring(arm, uart, buffer, sizeof(buffer));
-        if (n > 0) {
-            //dpr(buffer, nr, "RD: ");
-            int nw = write(arm->uart_q[uart].masterpty, buffer, nr);
-            if (nr != nw )
-                { if (arm_verbose) printf("3 wr: nr=%d nw=%d\n", nr,nw); }
+    armpty_writepty(arm, uart);
+}
+
+int armpty_readuart(arm_handle* arm, int do_idle)
+{
+    uint8_t uart;
+
+    if (do_idle) idle_op(arm);
+    for (uart = 0; (uart < arm->bv.uart_count) && (uart < MAX_UARTS); uart++) {
+        if ((arm->uart_q[uart].masterpty == -1) && (arm->uart_q[uart].sockfd == -1) &&
+            (arm->uart_q[uart].gateway == NULL)) continue;
+        armpty_flushtx(arm, uart);
+        armpty_readchannel(arm, uart);
+    }
+    return 0;
+}
+
+/* Boards without interrupt line are polled by timer. Period is doubled
+   while the lines are quiet up to the lowest latency target of uarts,
+   it is halved when chars are moving and drops to minimum if the board
+   still holds received chars */
+static uint32_t armpty_poll_max(arm_handle* arm)
+{
+    uint32_t max = 0;
+    uint8_t uart;
+
+    for (uart = 0; (uart < arm->bv.uart_count) && (uart < MAX_UARTS); uart++) {
+        uint32_t latency = arm->uart_q[uart].latency;
+        if ((latency > 0) && ((max == 0) || (latency < max))) max = latency;
+    }
+    if (max == 0) max = ARMPTY_POLL_LATENCY;
+    return (max < ARMPTY_POLL_MIN) ? ARMPTY_POLL_MIN : max;
+}
+
+static void armpty_settimer(arm_handle* arm, uint32_t usec)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = usec / 1000000;
+    its.it_value.tv_nsec = (usec % 1000000) * 1000;
+    timerfd_settime(arm->polltimer, 0, &its, NULL);
+}
+
+static void armpty_poll_settimer(arm_handle* arm)
+{
+    armpty_settimer(arm, arm->poll_interval);
+}
+
+/* Board with interrupt gets timer too, it only retries chars
+   not taken by board and is not running otherwise */
+int armpty_poll_open(arm_handle* arm)
+{
+    arm->polltimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (arm->polltimer < 0) return -1;
+    if (arm->fdint >= 0) return arm->polltimer;
+    arm->poll_interval = ARMPTY_POLL_MIN;
+    armpty_poll_settimer(arm);
+    return arm->polltimer;
+}
+
+/* Poll timer expired */
+void armpty_poll(arm_handle* arm)
+{
+    uint64_t expirations;
+    uint32_t moved = 0;
+    int busy = 0;
+    uint8_t uart;
+
+    if (read(arm->polltimer, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    if (arm->fdint >= 0) {
+        for (uart = 0; (uart < arm->bv.uart_count) && (uart < MAX_UARTS); uart++) {
+            if (armpty_flushtx(arm, uart) > 0) busy = 1;
         }
+        if (busy) armpty_settimer(arm, ARMPTY_POLL_MIN);
+        return;
+    }
+    for (uart = 0; (uart < arm->bv.uart_count) && (uart < MAX_UARTS); uart++)
+        moved -= arm->uart_q[uart].rx_count + arm->uart_q[uart].tx_count;
+    armpty_readuart(arm, 1);
+    for (uart = 0; (uart < arm->bv.uart_count) && (uart < MAX_UARTS); uart++) {
+        uart_queue* queue = &arm->uart_q[uart];
+        moved += queue->rx_count + queue->tx_count;
+        if ((queue->remain > 0) || (queue->txlen > 0)) busy = 1;
+    }
+
+    uint32_t max = armpty_poll_max(arm);
+    if (busy) {
+        arm->poll_interval = ARMPTY_POLL_MIN;
+    } else if (moved) {
+        arm->poll_interval >>= 1;
+    } else {
+        arm->poll_interval <<= 1;
+    }
+    if (arm->poll_interval < ARMPTY_POLL_MIN) arm->poll_interval = ARMPTY_POLL_MIN;
+    if (arm->poll_interval > max) arm->poll_interval = max;
+    armpty_poll_settimer(arm);
+}
+
+/* Chars were sent to board, reply is expected soon */
+void armpty_poll_kick(arm_handle* arm)
+{
+    if ((arm->polltimer < 0) || (arm->fdint >= 0) || (arm->poll_interval == ARMPTY_POLL_MIN)) return;
+    arm->poll_interval = ARMPTY_POLL_MIN;
+    armpty_poll_settimer(arm);
+}
+
+void armpty_print_stats(arm_handle* arm)
+{
+    uint8_t uart;
+
+    for (uart = 0; (uart < arm->bv.uart_count) && (uart < MAX_UARTS); uart++) {
+        uart_queue* queue = &arm->uart_q[uart];
+        printf("Board%d UART%d rx=%u tx=%u overflow=%d queued=%u/%u remote=%d\n", arm->index, uart,
+               queue->rx_count, queue->tx_count, queue->overflow, uq_used(queue), queue->size, queue->remain);
     }
+    if ((arm->polltimer >= 0) && (arm->fdint < 0))
+        printf("Board%d poll period=%uus\n", arm->index, arm->poll_interval);
 }
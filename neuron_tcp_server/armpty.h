@@ -11,11 +11,24 @@
 #ifndef __armpty_h
 #define __armpty_h
 
+#define ARMPTY_POLL_MIN      1000    // [us] polling period while chars are moving
+#define ARMPTY_POLL_LATENCY  20000   // [us] default latency target of polled uart
 
+void armpty_enable_int(arm_handle* arm);
 int armpty_open(arm_handle* arm, uint8_t uart);
 int armpty_setuart(int masterfd, arm_handle* arm, uint8_t uart);
+int armpty_setbaud(arm_handle* arm, uint8_t uart, int baud);
 int armpty_readpty(int masterfd, arm_handle* arm, uint8_t uart);
+int armpty_readsock(int sockfd, arm_handle* arm, uint8_t uart);
 int armpty_readuart(arm_handle* arm, int do_idle);
+int armpty_poll_open(arm_handle* arm);
+void armpty_poll(arm_handle* arm);
+void armpty_poll_kick(arm_handle* arm);
+void armpty_print_stats(arm_handle* arm);
+
+/* Called when input of uart (pty, raw tcp client) is to stop
+   being read (wait=1) and when it can be read again */
+extern void (*armpty_tx_hook)(arm_handle* arm, uint8_t uart, int wait);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,194 @@
+/*
+ * Replay of captured SPI trace through upper layers
+ *
+ * Every transfer of the trace is turned back into the call which produced
+ * it (Modbus/Tcp request for register and bit ops, uart op otherwise),
+ * replies come from the trace. Time spent in parsing, crc and response
+ * building is measured without SPI bus and board.
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "armspi.h"
+#include "armtrans.h"
+#include "nb_modbus.h"
+
+#define MAX_REQ 300
+
+static int build_req(uint8_t* req, uint8_t* pdu, int pdu_len)
+{
+    memset(req, 0, 4);
+    req[4] = (pdu_len + 1) >> 8;
+    req[5] = (pdu_len + 1) & 0xff;
+    req[6] = 1;                                    // first board
+    memcpy(req + 7, pdu, pdu_len);
+    return pdu_len + 7;
+}
+
+/* Drive upper layer to produce next transfer of trace. Returns -1 at end */
+static int replay_one(nb_modbus_t* nb_ctx, arm_handle* arm)
+{
+    arm_trace_record* rec;
+    uint8_t *tx, *tx2;
+    uint8_t pdu[MAX_REQ], req[MAX_REQ];
+    uint16_t* frame;
+    int i, len0, len2 = 0, cnt, n = 0;
+
+    if (arm_replay_peek(arm, &rec, &tx) < 2) return -1;
+    frame = (uint16_t*) (rec + 1);
+    len0 = frame[0];
+    for (i = 2; i < rec->frames; i++) len2 += frame[2 * i];
+    len2 -= CRC_SIZE;
+    arm_comm_header* hdr = (arm_comm_header*) (tx + len0);
+    tx2 = tx + len0 + SNIPLEN1;
+
+    if (rec->frames == 2) {
+        switch (hdr->op) {
+        case ARM_OP_IDLE:
+            idle_op(arm);
+            return 0;
+        case ARM_OP_WRITE_CHAR:
+            write_char(arm, hdr->reg, hdr->len);
+            return 0;
+        case ARM_OP_WRITE_BIT:
+            pdu[n++] = 0x05;
+            pdu[n++] = hdr->reg >> 8;
+            pdu[n++] = hdr->reg & 0xff;
+            pdu[n++] = hdr->len ? 0xff : 0;
+            pdu[n++] = 0;
+            break;
+        default:
+            arm_replay_skip(arm);
+            return 0;
+        }
+    } else {
+        switch (hdr->op) {
+        case ARM_OP_READ_REG:
+            cnt = (len2 - SIZEOF_HEADER) / 2;
+            pdu[n++] = 0x03;
+            pdu[n++] = hdr->reg >> 8;
+            pdu[n++] = hdr->reg & 0xff;
+            pdu[n++] = cnt >> 8;
+            pdu[n++] = cnt & 0xff;
+            break;
+        case ARM_OP_WRITE_REG:
+            cnt = ac_header(tx2)->len;
+            pdu[n++] = 0x10;
+            pdu[n++] = hdr->reg >> 8;
+            pdu[n++] = hdr->reg & 0xff;
+            pdu[n++] = cnt >> 8;
+            pdu[n++] = cnt & 0xff;
+            pdu[n++] = cnt * 2;
+            for (i = 0; i < cnt; i++) {            // board order is little endian
+                pdu[n++] = tx2[SIZEOF_HEADER + 2 * i + 1];
+                pdu[n++] = tx2[SIZEOF_HEADER + 2 * i];
+            }
+            break;
+        case ARM_OP_READ_BIT:
+            cnt = (len2 - SIZEOF_HEADER) * 8;
+            if (cnt > MODBUS_MAX_READ_BITS) cnt = MODBUS_MAX_READ_BITS;
+            pdu[n++] = 0x01;
+            pdu[n++] = hdr->reg >> 8;
+            pdu[n++] = hdr->reg & 0xff;
+            pdu[n++] = cnt >> 8;
+            pdu[n++] = cnt & 0xff;
+            break;
+        case ARM_OP_WRITE_BITS:
+            cnt = ac_header(tx2)->len;
+            pdu[n++] = 0x0f;
+            pdu[n++] = hdr->reg >> 8;
+            pdu[n++] = hdr->reg & 0xff;
+            pdu[n++] = cnt >> 8;
+            pdu[n++] = cnt & 0xff;
+            pdu[n++] = (cnt + 7) >> 3;
+            memcpy(pdu + n, tx2 + SIZEOF_HEADER, (cnt + 7) >> 3);
+            n += (cnt + 7) >> 3;
+            break;
+        case ARM_OP_WRITE_STR:
+            write_string(arm, hdr->reg, tx2, hdr->len ? hdr->len : 256);
+            return 0;
+        case ARM_OP_READ_STR:
+            if (hdr->reg < MAX_UARTS) {
+                uart_queue* queue = &arm->uart_q[hdr->reg];
+                uq_consume(queue, uq_used(queue));
+                fetch_string(arm, hdr->reg, len2 - SIZEOF_HEADER);
+                uq_consume(queue, uq_used(queue));
+                return 0;
+            }
+            arm_replay_skip(arm);
+            return 0;
+        default:
+            arm_replay_skip(arm);
+            return 0;
+        }
+    }
+    nb_modbus_reply(nb_ctx, req, build_req(req, pdu, n));
+    return 0;
+}
+
+static void print_usage(const char *progname)
+{
+    printf("usage: %s [-v] [-n iterations] tracefile\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 100;
+    int c, i, ops = 0;
+    struct timespec t1, t2;
+    char device[256];
+
+    while ((c = getopt(argc, argv, "vn:")) != -1) {
+        switch (c) {
+        case 'v':
+            verbose++;
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((optind >= argc) || (iterations <= 0)) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    nb_modbus_t* nb_ctx = nb_modbus_new_tcp("127.0.0.1", 502);
+    snprintf(device, sizeof(device), "replay:%s", argv[optind]);
+    add_arm(nb_ctx, 0, device, 0, NULL);
+    if (nb_ctx->arm[0] == NULL) {
+        printf("Cannot replay %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    arm_handle* arm = nb_ctx->arm[0];
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (i = 0; i < iterations; i++) {
+        arm_replay_rewind(arm);
+        while (replay_one(nb_ctx, arm) == 0) ops++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    double ns = (t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec);
+    uint32_t mismatches = arm_replay_mismatches(arm);
+    printf("transfers=%d iterations=%d total=%.3fms per transfer=%.0fns mismatches=%u\n",
+           ops / iterations, iterations, ns / 1e6, ops ? ns / ops : 0.0, mismatches);
+    nb_modbus_free(nb_ctx);
+    return mismatches ? 1 : 0;
+}
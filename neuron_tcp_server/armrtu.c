@@ -0,0 +1,593 @@
+/*
+ * Modbus RTU master on UART of UniPi Neuron family controllers
+ *
+ * Requests received by Modbus/Tcp server for configured unit ids are
+ * queued per uart, framed as RTU and sent to downstream slaves.
+ * Blocks from scan list are polled by gateway itself when the line
+ * is free and tcp reads inside them are answered from last data.
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ * Copyright © 2001-2011 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "armrtu.h"
+#include "armpty.h"
+
+#define _MODBUS_TCP_HEADER_LENGTH  7
+#define EXCEPTION_GATEWAY_TARGET   0x0B
+#define EXCEPTION_BUSY             0x06
+
+/* Table of CRC values for high-order byte (from libmodbus modbus-rtu.c) */
+static const uint8_t table_crc_hi[] = {
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
+    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
+    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40, 0x00, 0xC1, 0x81, 0x40,
+    0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0, 0x80, 0x41, 0x00, 0xC1,
+    0x81, 0x40, 0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41,
+    0x00, 0xC1, 0x81, 0x40, 0x01, 0xC0, 0x80, 0x41, 0x01, 0xC0,
+    0x80, 0x41, 0x00, 0xC1, 0x81, 0x40
+};
+
+/* Table of CRC values for low-order byte */
+static const uint8_t table_crc_lo[] = {
+    0x00, 0xC0, 0xC1, 0x01, 0xC3, 0x03, 0x02, 0xC2, 0xC6, 0x06,
+    0x07, 0xC7, 0x05, 0xC5, 0xC4, 0x04, 0xCC, 0x0C, 0x0D, 0xCD,
+    0x0F, 0xCF, 0xCE, 0x0E, 0x0A, 0xCA, 0xCB, 0x0B, 0xC9, 0x09,
+    0x08, 0xC8, 0xD8, 0x18, 0x19, 0xD9, 0x1B, 0xDB, 0xDA, 0x1A,
+    0x1E, 0xDE, 0xDF, 0x1F, 0xDD, 0x1D, 0x1C, 0xDC, 0x14, 0xD4,
+    0xD5, 0x15, 0xD7, 0x17, 0x16, 0xD6, 0xD2, 0x12, 0x13, 0xD3,
+    0x11, 0xD1, 0xD0, 0x10, 0xF0, 0x30, 0x31, 0xF1, 0x33, 0xF3,
+    0xF2, 0x32, 0x36, 0xF6, 0xF7, 0x37, 0xF5, 0x35, 0x34, 0xF4,
+    0x3C, 0xFC, 0xFD, 0x3D, 0xFF, 0x3F, 0x3E, 0xFE, 0xFA, 0x3A,
+    0x3B, 0xFB, 0x39, 0xF9, 0xF8, 0x38, 0x28, 0xE8, 0xE9, 0x29,
+    0xEB, 0x2B, 0x2A, 0xEA, 0xEE, 0x2E, 0x2F, 0xEF, 0x2D, 0xED,
+    0xEC, 0x2C, 0xE4, 0x24, 0x25, 0xE5, 0x27, 0xE7, 0xE6, 0x26,
+    0x22, 0xE2, 0xE3, 0x23, 0xE1, 0x21, 0x20, 0xE0, 0xA0, 0x60,
+    0x61, 0xA1, 0x63, 0xA3, 0xA2, 0x62, 0x66, 0xA6, 0xA7, 0x67,
+    0xA5, 0x65, 0x64, 0xA4, 0x6C, 0xAC, 0xAD, 0x6D, 0xAF, 0x6F,
+    0x6E, 0xAE, 0xAA, 0x6A, 0x6B, 0xAB, 0x69, 0xA9, 0xA8, 0x68,
+    0x78, 0xB8, 0xB9, 0x79, 0xBB, 0x7B, 0x7A, 0xBA, 0xBE, 0x7E,
+    0x7F, 0xBF, 0x7D, 0xBD, 0xBC, 0x7C, 0xB4, 0x74, 0x75, 0xB5,
+    0x77, 0xB7, 0xB6, 0x76, 0x72, 0xB2, 0xB3, 0x73, 0xB1, 0x71,
+    0x70, 0xB0, 0x50, 0x90, 0x91, 0x51, 0x93, 0x53, 0x52, 0x92,
+    0x96, 0x56, 0x57, 0x97, 0x55, 0x95, 0x94, 0x54, 0x9C, 0x5C,
+    0x5D, 0x9D, 0x5F, 0x9F, 0x9E, 0x5E, 0x5A, 0x9A, 0x9B, 0x5B,
+    0x99, 0x59, 0x58, 0x98, 0x88, 0x48, 0x49, 0x89, 0x4B, 0x8B,
+    0x8A, 0x4A, 0x4E, 0x8E, 0x8F, 0x4F, 0x8D, 0x4D, 0x4C, 0x8C,
+    0x44, 0x84, 0x85, 0x45, 0x87, 0x47, 0x46, 0x86, 0x82, 0x42,
+    0x43, 0x83, 0x41, 0x81, 0x80, 0x40
+};
+
+uint16_t rtu_crc16(uint8_t *buffer, uint16_t buffer_length)
+{
+    uint8_t crc_hi = 0xFF; /* high CRC byte initialized */
+    uint8_t crc_lo = 0xFF; /* low CRC byte initialized */
+    unsigned int i; /* will index into CRC lookup */
+
+    /* pass through message buffer */
+    while (buffer_length--) {
+        i = crc_hi ^ *buffer++; /* calculate the CRC  */
+        crc_hi = crc_lo ^ table_crc_hi[i];
+        crc_lo = table_crc_lo[i];
+    }
+
+    return (crc_hi << 8 | crc_lo);
+}
+
+
+static uint64_t rtu_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void rtu_set_timer(rtu_channel* channel, uint32_t usec)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = usec / 1000000;
+    its.it_value.tv_nsec = (usec % 1000000) * 1000;
+    timerfd_settime(channel->timerfd, 0, &its, NULL);
+}
+
+/* Time to transfer len chars on line (start + 8 data + parity/stop + stop) */
+static uint32_t rtu_chars_time(rtu_channel* channel, int len)
+{
+    return (uint32_t)(((uint64_t) len * 11 * 1000000) / channel->baud);
+}
+
+rtu_channel* rtu_channel_new(arm_handle* arm, uint8_t uart, int baud, int timeout, rtu_reply_cb reply)
+{
+    rtu_channel* channel = calloc(1, sizeof(rtu_channel));
+    if (channel == NULL) return NULL;
+
+    channel->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (channel->timerfd < 0) {
+        free(channel);
+        return NULL;
+    }
+    channel->arm = arm;
+    channel->uart = uart;
+    channel->baud = (baud > 0) ? baud : RTU_DEFAULT_BAUD;
+    channel->timeout = (timeout > 0) ? timeout : RTU_DEFAULT_TIMEOUT;
+    // Modbus spec: fixed 1750us above 19200 Bd
+    channel->t35 = (channel->baud > 19200) ? 1750 : (rtu_chars_time(channel, 7) >> 1);
+    channel->reply = reply;
+    channel->state = RTU_IDLE;
+    arm->uart_q[uart].gateway = channel;
+    return channel;
+}
+
+void rtu_channel_free(rtu_channel* channel)
+{
+    rtu_trans* trans;
+
+    if (channel == NULL) return;
+    free(channel->current);
+    free(channel->polls);
+    while ((trans = channel->head) != NULL) {
+        channel->head = trans->next;
+        free(trans);
+    }
+    channel->arm->uart_q[channel->uart].gateway = NULL;
+    close(channel->timerfd);
+    free(channel);
+}
+
+/* Answer request with Modbus exception */
+static void rtu_exception(rtu_channel* channel, rtu_trans* trans, int exception_code)
+{
+    uint8_t* rsp = trans->req;
+    if (trans->owner == NULL) return;
+    rsp[_MODBUS_TCP_HEADER_LENGTH] |= 0x80;
+    rsp[_MODBUS_TCP_HEADER_LENGTH + 1] = exception_code;
+    rsp[4] = 0;
+    rsp[5] = 3;
+    channel->reply(trans->owner, rsp, _MODBUS_TCP_HEADER_LENGTH + 2);
+}
+
+/* Length of data in read response */
+static int rtu_poll_bytes(uint8_t fc, uint16_t count)
+{
+    return (fc <= 2) ? (count + 7) / 8 : count * 2;
+}
+
+/* Scan of block which is due, otherwise timer is set to the nearest one */
+static rtu_trans* rtu_next_poll(rtu_channel* channel)
+{
+    uint64_t now = rtu_now_ms();
+    rtu_poll* poll = NULL;
+    int i;
+
+    for (i = 0; i < channel->poll_count; i++) {
+        if ((poll == NULL) || (channel->polls[i].next_due < poll->next_due))
+            poll = &channel->polls[i];
+    }
+    if (poll == NULL) return NULL;
+    if (poll->next_due > now) {
+        rtu_set_timer(channel, (poll->next_due - now) * 1000);
+        return NULL;
+    }
+    poll->next_due += poll->period;
+    if (poll->next_due <= now) poll->next_due = now + poll->period;
+
+    rtu_trans* trans = malloc(sizeof(rtu_trans));
+    if (trans == NULL) return NULL;
+    trans->next = NULL;
+    trans->owner = NULL;
+    trans->poll = poll;
+    trans->req_length = 12;
+    uint8_t* req = trans->req;
+    memset(req, 0, 4);
+    req[4] = 0;
+    req[5] = 6;
+    req[6] = poll->unit;
+    req[7] = poll->fc;
+    req[8] = poll->addr >> 8;
+    req[9] = poll->addr & 0xff;
+    req[10] = poll->count >> 8;
+    req[11] = poll->count & 0xff;
+    poll->polls++;
+    return trans;
+}
+
+/* Put next waiting request on the line. Tcp requests go first,
+   blocks from scan list only when nobody waits */
+static void rtu_send_next(rtu_channel* channel)
+{
+    rtu_trans* trans = channel->head;
+    uint8_t frame[RTU_MAX_ADU_LENGTH];
+    int len, pos, n;
+
+    if (channel->state != RTU_IDLE) return;
+    if (trans != NULL) {
+        channel->head = trans->next;
+        if (channel->head == NULL) channel->tail = NULL;
+        channel->pending--;
+    } else {
+        trans = rtu_next_poll(channel);
+        if (trans == NULL) return;
+    }
+
+    // unit id + pdu from Modbus/Tcp request, crc appended
+    len = trans->req_length - (_MODBUS_TCP_HEADER_LENGTH - 1);
+    memcpy(frame, trans->req + _MODBUS_TCP_HEADER_LENGTH - 1, len);
+    uint16_t crc = rtu_crc16(frame, len);
+    frame[len++] = crc >> 8;
+    frame[len++] = crc & 0xff;
+
+    // drop stale chars from previous frames
+    uart_queue* queue = &channel->arm->uart_q[channel->uart];
+    uq_consume(queue, uq_used(queue));
+
+    for (pos = 0; pos < len; pos += n) {
+        n = len - pos;
+        if (n > SPI_STR_MAX) n = SPI_STR_MAX;
+        int sent = write_string(channel->arm, channel->uart, frame + pos, n);
+        if (sent < n) {
+            if (trans->poll) trans->poll->errors++;
+            rtu_exception(channel, trans, EXCEPTION_GATEWAY_TARGET);
+            free(trans);
+            if (sent < 0) {
+                rtu_send_next(channel);
+                return;
+            }
+            // board tx buffer is full and frame can't be sent in pieces,
+            // let the line drain and slaves drop the broken frame
+            channel->state = RTU_TURNAROUND;
+            rtu_set_timer(channel, rtu_chars_time(channel, len) + channel->t35);
+            return;
+        }
+    }
+    armpty_poll_kick(channel->arm);
+    channel->requests++;
+    channel->current = trans;
+    channel->rsp_length = 0;
+    channel->state = RTU_WAIT_RSP;
+    rtu_set_timer(channel, rtu_chars_time(channel, len) + channel->timeout * 1000);
+}
+
+/* Answer read request from scan data if it is fresh. Returns 1 if answered */
+static int rtu_cache_read(rtu_channel* channel, void* owner, uint8_t* req, int req_length)
+{
+    uint8_t rsp[_MODBUS_TCP_HEADER_LENGTH + 2 + RTU_MAX_POLL_DATA];
+    uint8_t unit = req[6];
+    uint8_t fc = req[7];
+    uint16_t addr, count, off;
+    int i, b, nbytes, known = 0;
+
+    if ((channel->poll_count == 0) || (req_length != 12) || (fc < 1) || (fc > 4))
+        return 0;
+    addr = (req[8] << 8) | req[9];
+    count = (req[10] << 8) | req[11];
+    uint64_t now = rtu_now_ms();
+
+    for (i = 0; i < channel->poll_count; i++) {
+        rtu_poll* poll = &channel->polls[i];
+        if (poll->unit != unit) continue;
+        known = 1;
+        if ((poll->fc != fc) || !poll->valid || (count == 0) || (addr < poll->addr) ||
+            ((uint32_t) addr + count > (uint32_t) poll->addr + poll->count))
+            continue;
+        // data missed two scans (slave offline?) - let request go to the line
+        if (now - poll->updated > (uint64_t) 2 * poll->period + channel->timeout)
+            continue;
+
+        off = addr - poll->addr;
+        nbytes = rtu_poll_bytes(fc, count);
+        memcpy(rsp, req, 8);               // MBAP + unit + fc
+        if (fc <= 2) {
+            memset(rsp + 9, 0, nbytes);
+            for (b = 0; b < count; b++, off++) {
+                if (poll->data[off >> 3] & (1 << (off & 7)))
+                    rsp[9 + (b >> 3)] |= 1 << (b & 7);
+            }
+        } else {
+            memcpy(rsp + 9, poll->data + off * 2, nbytes);
+        }
+        rsp[4] = (nbytes + 3) >> 8;
+        rsp[5] = (nbytes + 3) & 0xff;
+        rsp[8] = nbytes;
+        channel->cache_hits++;
+        channel->reply(owner, rsp, nbytes + 9);
+        return 1;
+    }
+    if (known) channel->cache_misses++;
+    return 0;
+}
+
+/* Write request changes scanned block - read it again as soon as possible */
+static void rtu_poll_refresh(rtu_channel* channel, uint8_t* req, int req_length)
+{
+    uint8_t fc;
+    uint16_t addr = (req[8] << 8) | req[9];
+    uint16_t count = 1;
+    int i;
+
+    if (req_length < 12) return;
+    switch (req[7]) {
+    case 0x05: fc = 0x01; break;
+    case 0x0F: fc = 0x01; count = (req[10] << 8) | req[11]; break;
+    case 0x06: case 0x16: fc = 0x03; break;
+    case 0x10: fc = 0x03; count = (req[10] << 8) | req[11]; break;
+    case 0x17:
+        if (req_length < 16) return;
+        fc = 0x03;
+        addr = (req[12] << 8) | req[13];
+        count = (req[14] << 8) | req[15];
+        break;
+    default: return;
+    }
+    for (i = 0; i < channel->poll_count; i++) {
+        rtu_poll* poll = &channel->polls[i];
+        if ((poll->unit == req[6]) && (poll->fc == fc) &&
+            ((uint32_t) addr + count > poll->addr) && (addr < (uint32_t) poll->addr + poll->count))
+            poll->next_due = 0;
+    }
+}
+
+static int rtu_is_write(uint8_t fc)
+{
+    switch (fc) {
+    case 0x05: case 0x06: case 0x0F: case 0x10: case 0x16: case 0x17:
+        return 1;
+    }
+    return 0;
+}
+
+/* Request is in Modbus/Tcp format incl. MBAP header */
+int rtu_submit(rtu_channel* channel, void* owner, uint8_t* req, int req_length)
+{
+    if ((req_length <= _MODBUS_TCP_HEADER_LENGTH) || 
+        (req_length - (_MODBUS_TCP_HEADER_LENGTH - 1) > RTU_MAX_ADU_LENGTH - 2)) {
+        return -1;
+    }
+    if (rtu_cache_read(channel, owner, req, req_length))
+        return 0;
+
+    rtu_trans* trans = malloc(sizeof(rtu_trans));
+    if (trans == NULL) return -1;
+    trans->next = NULL;
+    trans->owner = owner;
+    trans->poll = NULL;
+    trans->req_length = req_length;
+    memcpy(trans->req, req, req_length);
+
+    if (channel->pending >= RTU_MAX_PENDING) {
+        rtu_exception(channel, trans, EXCEPTION_BUSY);
+        free(trans);
+        return 0;
+    }
+    if (rtu_is_write(req[_MODBUS_TCP_HEADER_LENGTH])) {
+        // writes overtake waiting reads, order of writes is kept
+        rtu_trans** pt = &channel->head;
+        while ((*pt != NULL) && rtu_is_write((*pt)->req[_MODBUS_TCP_HEADER_LENGTH]))
+            pt = &(*pt)->next;
+        trans->next = *pt;
+        *pt = trans;
+        if (trans->next == NULL) channel->tail = trans;
+        rtu_poll_refresh(channel, req, req_length);
+    } else {
+        if (channel->tail) {
+            channel->tail->next = trans;
+        } else {
+            channel->head = trans;
+        }
+        channel->tail = trans;
+    }
+    channel->pending++;
+    rtu_send_next(channel);
+    return 0;
+}
+
+/* Add block to scan list. Must be called before the line is running */
+int rtu_poll_add(rtu_channel* channel, uint8_t unit, uint8_t fc, uint16_t addr, uint16_t count, int period)
+{
+    if ((fc < 1) || (fc > 4) || (count == 0) || 
+        (rtu_poll_bytes(fc, count) > RTU_MAX_POLL_DATA) ||
+        ((uint32_t) addr + count > 0x10000))
+        return -1;
+    rtu_poll* polls = realloc(channel->polls, (channel->poll_count + 1) * sizeof(rtu_poll));
+    if (polls == NULL) return -1;
+    channel->polls = polls;
+    rtu_poll* poll = &polls[channel->poll_count++];
+    memset(poll, 0, sizeof(rtu_poll));
+    poll->unit = unit;
+    poll->fc = fc;
+    poll->addr = addr;
+    poll->count = count;
+    poll->period = (period > 0) ? period : RTU_DEFAULT_PERIOD;
+    poll->next_due = rtu_now_ms();
+    // first scan is started from event loop
+    if (channel->state == RTU_IDLE) rtu_set_timer(channel, 1000);
+    return 0;
+}
+
+/* Owner (connection) has gone, forget its transactions */
+void rtu_cancel(rtu_channel* channel, void* owner)
+{
+    rtu_trans** pt = &channel->head;
+    rtu_trans* trans;
+
+    channel->tail = NULL;
+    while ((trans = *pt) != NULL) {
+        if (trans->owner == owner) {
+            *pt = trans->next;
+            channel->pending--;
+            free(trans);
+        } else {
+            channel->tail = trans;
+            pt = &trans->next;
+        }
+    }
+    // transaction on the line must be finished, only response is dropped
+    if (channel->current && (channel->current->owner == owner))
+        channel->current->owner = NULL;
+}
+
+/* Expected length of response frame, 0 if not known yet, -1 if not defined */
+static int rtu_expected_length(uint8_t* rsp, int len)
+{
+    if (len < 2) return 0;
+    if (rsp[1] & 0x80) return 5;
+    switch (rsp[1]) {
+    case 0x01: case 0x02: case 0x03: case 0x04:
+    case 0x11: case 0x17:
+        if (len < 3) return 0;
+        return 3 + rsp[2] + 2;
+    case 0x05: case 0x06: case 0x0F: case 0x10:
+        return 8;
+    case 0x07:
+        return 5;
+    case 0x16:
+        return 10;
+    }
+    return -1;
+}
+
+/* Store response of block scan */
+static void rtu_poll_update(rtu_poll* poll, uint8_t* rsp, int len)
+{
+    int nbytes = rtu_poll_bytes(poll->fc, poll->count);
+
+    if ((rsp != NULL) && (rsp[1] == poll->fc) && (rsp[2] == nbytes) && (len == 3 + nbytes)) {
+        memcpy(poll->data, rsp + 3, nbytes);
+        poll->updated = rtu_now_ms();
+        poll->valid = 1;
+        return;
+    }
+    poll->errors++;
+    // slave refuses the block, tcp reads must get its exception
+    if ((rsp != NULL) && (rsp[1] & 0x80)) poll->valid = 0;
+}
+
+/* Finish transaction on line and schedule the next one after t3.5 */
+static void rtu_finish(rtu_channel* channel, int timeout)
+{
+    rtu_trans* trans = channel->current;
+    int len = channel->rsp_length;
+    uint8_t* rsp = trans->req;
+
+    channel->current = NULL;
+    if (timeout) channel->timeouts++;
+    int valid = (len >= 4) && (channel->rsp[0] == trans->req[_MODBUS_TCP_HEADER_LENGTH - 1]) &&
+                (rtu_crc16(channel->rsp, len - 2) == ((channel->rsp[len-2] << 8) | channel->rsp[len-1]));
+    if (!valid && (len > 0)) channel->crc_errors++;
+
+    if (trans->poll != NULL) {
+        rtu_poll_update(trans->poll, valid ? channel->rsp : NULL, len - 2);
+    } else if (trans->owner != NULL) {
+        if (valid) {
+            // unit id + pdu back to Modbus/Tcp
+            memcpy(rsp + _MODBUS_TCP_HEADER_LENGTH - 1, channel->rsp, len - 2);
+            int mbap_length = len - 2;
+            rsp[4] = mbap_length >> 8;
+            rsp[5] = mbap_length & 0xff;
+            channel->reply(trans->owner, rsp, mbap_length + 6);
+        } else {
+            rtu_exception(channel, trans, EXCEPTION_GATEWAY_TARGET);
+        }
+    }
+    free(trans);
+    channel->state = RTU_TURNAROUND;
+    rtu_set_timer(channel, channel->t35);
+}
+
+/* New chars in uart ring */
+void rtu_receive(rtu_channel* channel)
+{
+    uart_queue* queue = &channel->arm->uart_q[channel->uart];
+    uint8_t* data;
+    int len;
+
+    if (channel->state != RTU_WAIT_RSP) {
+        uq_consume(queue, uq_used(queue));             // noise on line
+        return;
+    }
+    while ((len = uq_peek(queue, &data)) > 0) {
+        if (len > RTU_MAX_ADU_LENGTH - channel->rsp_length)
+            len = RTU_MAX_ADU_LENGTH - channel->rsp_length;
+        memcpy(channel->rsp + channel->rsp_length, data, len);
+        uq_consume(queue, len);
+        channel->rsp_length += len;
+        if (channel->rsp_length == RTU_MAX_ADU_LENGTH) break;
+    }
+    int expected = rtu_expected_length(channel->rsp, channel->rsp_length);
+    if ((channel->rsp_length == RTU_MAX_ADU_LENGTH) || 
+        ((expected > 0) && (channel->rsp_length >= expected))) {
+        if (expected > 0) channel->rsp_length = expected;
+        rtu_finish(channel, 0);
+    }
+}
+
+/* Timerfd of channel expired */
+void rtu_timer(rtu_channel* channel)
+{
+    uint64_t expirations;
+    if (read(channel->timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    if (channel->state == RTU_WAIT_RSP) {
+        // frame of unknown length is complete on timeout
+        rtu_finish(channel, rtu_expected_length(channel->rsp, channel->rsp_length) >= 0);
+    } else if (channel->state == RTU_TURNAROUND) {
+        channel->state = RTU_IDLE;
+        rtu_send_next(channel);
+    } else {
+        // scan of next block is due
+        rtu_send_next(channel);
+    }
+}
+
+void rtu_print_stats(rtu_channel* channel)
+{
+    printf("Board%d UART%d gateway requests=%u timeouts=%u crc_errors=%u pending=%d\n",
+           channel->arm->index, channel->uart, channel->requests,
+           channel->timeouts, channel->crc_errors, channel->pending);
+    if (channel->poll_count == 0) return;
+
+    uint64_t now = rtu_now_ms();
+    int i;
+    printf("  cache hits=%u misses=%u\n", channel->cache_hits, channel->cache_misses);
+    for (i = 0; i < channel->poll_count; i++) {
+        rtu_poll* poll = &channel->polls[i];
+        printf("  unit=%d fc=%d addr=%d count=%d period=%dms polls=%u errors=%u age=",
+               poll->unit, poll->fc, poll->addr, poll->count, poll->period, poll->polls, poll->errors);
+        if (poll->valid)
+            printf("%llums\n", (unsigned long long)(now - poll->updated));
+        else
+            printf("-\n");
+    }
+}
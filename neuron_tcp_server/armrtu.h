@@ -0,0 +1,93 @@
+/*
+ * Modbus RTU master on UART of UniPi Neuron family controllers
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+#ifndef __armrtu_h
+#define __armrtu_h
+
+#include <stdint.h>
+#include "armspi.h"
+
+#define RTU_MAX_ADU_LENGTH     256
+#define RTU_MAX_PENDING        32    // max queued transactions per line
+#define RTU_DEFAULT_BAUD       19200
+#define RTU_DEFAULT_TIMEOUT    500   // response timeout [ms]
+#define RTU_DEFAULT_PERIOD     1000  // scan period of cached block [ms]
+#define RTU_MAX_POLL_DATA      250   // 125 registers or 2000 bits
+
+#define RTU_IDLE       0
+#define RTU_WAIT_RSP   1             // request sent, waiting for response
+#define RTU_TURNAROUND 2             // t3.5 silence before next request
+
+/* Called when response (or exception) for request is ready.
+   rsp is in Modbus/Tcp format incl. MBAP header */
+typedef void (*rtu_reply_cb)(void* owner, uint8_t* rsp, int rsp_length);
+
+/* Block of downstream slave registers polled by gateway itself.
+   Tcp reads inside the block are answered from data */
+typedef struct {
+    uint8_t unit;
+    uint8_t fc;                      // 1..4
+    uint16_t addr;
+    uint16_t count;
+    int period;                      // [ms]
+    uint64_t next_due;               // [ms] monotonic
+    uint64_t updated;                // [ms] monotonic, time of last valid data
+    int valid;
+    uint8_t data[RTU_MAX_POLL_DATA]; // data bytes of read response
+    // statistics
+    uint32_t polls;
+    uint32_t errors;
+} rtu_poll;
+
+typedef struct _rtu_trans rtu_trans;
+struct _rtu_trans {
+    rtu_trans* next;
+    void* owner;
+    rtu_poll* poll;                  // scan of cached block, owner is NULL
+    int req_length;
+    uint8_t req[RTU_MAX_ADU_LENGTH + 8];  // Modbus/Tcp request
+};
+
+typedef struct {
+    arm_handle* arm;
+    uint8_t uart;
+    int baud;
+    int timeout;                     // response timeout [ms]
+    uint32_t t35;                    // inter-frame silence [us]
+    int timerfd;
+    int state;
+    rtu_trans* head;                 // waiting transactions
+    rtu_trans* tail;
+    rtu_trans* current;              // transaction on the line
+    int pending;
+    uint8_t rsp[RTU_MAX_ADU_LENGTH];
+    int rsp_length;
+    rtu_reply_cb reply;
+    rtu_poll* polls;                 // scan list
+    int poll_count;
+    // statistics
+    uint32_t requests;
+    uint32_t timeouts;
+    uint32_t crc_errors;
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+} rtu_channel;
+
+uint16_t rtu_crc16(uint8_t *buffer, uint16_t buffer_length);
+rtu_channel* rtu_channel_new(arm_handle* arm, uint8_t uart, int baud, int timeout, rtu_reply_cb reply);
+void rtu_channel_free(rtu_channel* channel);
+int rtu_submit(rtu_channel* channel, void* owner, uint8_t* req, int req_length);
+int rtu_poll_add(rtu_channel* channel, uint8_t unit, uint8_t fc, uint16_t addr, uint16_t count, int period);
+void rtu_cancel(rtu_channel* channel, void* owner);
+void rtu_receive(rtu_channel* channel);
+void rtu_timer(rtu_channel* channel);
+void rtu_print_stats(rtu_channel* channel);
+
+#endif
@@ -21,22 +21,13 @@
 #include <sys/ioctl.h>
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
+#include <linux/gpio.h>
+#include <time.h>
 #include <string.h>
 #include "armspi.h"
 #include "armutil.h"
 
-// brain/modbus_prot.h
-#define ARM_OP_READ_BIT   1
-#define ARM_OP_READ_REG   4
-#define ARM_OP_WRITE_BIT  5
-#define ARM_OP_WRITE_REG  6
-#define ARM_OP_WRITE_BITS 15
-
-#define ARM_OP_WRITE_CHAR  65
-#define ARM_OP_WRITE_STR   100
-#define ARM_OP_READ_STR    101
-
-#define ARM_OP_IDLE        0xfa
+#include "armtrans.h"
 
 
 // !!!! on RPI 2,3 doesn't work transfer longer then 94 bytes. Must be divided into chunks
@@ -45,20 +36,13 @@
 //#define _MAX_SPI_RX  256
 
 
-#define ac_header(buf) ((arm_comm_header*)buf)
-#define ach_header(buf) ((arm_comm_chr_header*)buf)
-#define acs_header(buf) ((arm_comm_str_header*)buf)
 
-#define IDLE_PATTERN 0x0e5500fa
-// hodnota 240 znaku by pravdepodobne mela byt spise 
-//    255 - sizeof(arm_comm_header) = 251 -> 250(sude cislo) znaku 
-// vyzkouset jestli neni problem v firmware
-#define SPI_STR_MAX 240
 #define NSS_PAUSE_DEFAULT  10
 
 //static int be_quiet = 0;
 int arm_verbose = 0;
 int nss_pause = NSS_PAUSE_DEFAULT;
+uint32_t uart_queue_len = MAX_LOCAL_QUEUE_LEN;
 static void pabort(const char *s)
 {
     if (arm_verbose > 0) perror(s);
@@ -106,14 +90,92 @@ void set_spi_speed(int fd, uint32_t speed)
     }
 }
 
+/* Store received chars into ring, drop what does not fit */
+static int uq_put(uart_queue* queue, uint8_t* str, uint32_t cnt)
+{
+    uint32_t free = uq_free(queue);
+    if (cnt > free) {
+        queue->overflow += cnt - free;
+        cnt = free;
+    }
+    uint32_t pos = queue->head & (queue->size - 1);
+    uint32_t first = queue->size - pos;
+    if (first > cnt) first = cnt;
+    memcpy(queue->ring + pos, str, first);
+    memcpy(queue->ring, str + first, cnt - first);
+    queue->head += cnt;
+    return cnt;
+}
+
+/* Contiguous part of waiting chars, data can be used directly without copy */
+int uq_peek(uart_queue* queue, uint8_t** str)
+{
+    uint32_t pos = queue->tail & (queue->size - 1);
+    uint32_t used = uq_used(queue);
+    *str = queue->ring + pos;
+    return (pos + used > queue->size) ? queue->size - pos : used;
+}
+
+void uq_consume(uart_queue* queue, int cnt)
+{
+    queue->tail += cnt;
+}
+
 void queue_uart(uart_queue* queue, uint8_t chr1, uint8_t len)
 {
     queue->remain = (len==0) ? 255 : len - 1;  // len==0 means 256 byte in remote queue
-    if (queue->index < MAX_LOCAL_QUEUE_LEN) {
-        queue->buffer[queue->index++] = chr1;
-    } else {
-        queue->overflow++;
+    queue->rx_count++;
+    uq_put(queue, &chr1, 1);
+}
+
+static uint64_t arm_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void arm_link_speed(arm_handle* arm, uint32_t speed)
+{
+    arm->trans->set_speed(arm, speed);
+    arm->speed = speed;
+    arm->link_clean = arm_now_ms();
+    if (arm_verbose) printf("Board%d spi speed %uHz\n", arm->index, speed);
+}
+
+/* Result of crc check of every transfer. Burst of errors steps spi clock
+   down by quarter, long clean period lets it try a step up again */
+static void arm_link_update(arm_handle* arm, int error)
+{
+    uint32_t speed;
+
+    arm->link_xfers++;
+    if (error) {
+        arm->crc_errors++;
+        arm->link_errors++;
+        arm->link_clean = arm_now_ms();
+    }
+    if (arm->link_hold) return;
+    if (arm->link_errors >= ARM_LINK_BURST) {
+        speed = arm->speed - arm->speed / 4;
+        if (speed < ARM_LINK_MIN_SPEED) speed = ARM_LINK_MIN_SPEED;
+        if (speed < arm->speed) {
+            arm_link_speed(arm, speed);
+            arm->speed_down++;
+        }
+    } else if (arm->link_xfers < ARM_LINK_WINDOW) {
+        return;
+    } else if ((arm->link_errors == 0) && (arm->speed < arm->max_speed) &&
+               (arm_now_ms() - arm->link_clean > ARM_LINK_CLEAN)) {
+        speed = arm->speed + arm->speed / 3;
+        if (speed > arm->max_speed) speed = arm->max_speed;
+        arm_link_speed(arm, speed);
+        arm->speed_up++;
     }
+    // window is closed by its end or by burst of errors
+    arm->link_rate = (arm->link_rate * 3 + (uint64_t) arm->link_errors * 1000000 / arm->link_xfers) / 4;
+    arm->link_xfers = 0;
+    arm->link_errors = 0;
 }
 
 int one_phase_op(arm_handle* arm, uint8_t op, uint16_t reg, uint8_t value)
@@ -125,24 +187,28 @@ int one_phase_op(arm_handle* arm, uint8_t op, uint16_t reg, uint8_t value)
     arm->tx1.crc = SpiCrcString((uint8_t*)&arm->tx1, SIZEOF_HEADER, 0);
 
     arm->tr[1].delay_usecs = 0;
-    ret = ioctl(arm->fd, SPI_IOC_MESSAGE(2), arm->tr);
+    ret = arm->trans->transfer(arm, arm->tr, 2);
     if (ret < 1) {
         pabort("Can't send one-phase spi message");
         return -1;
     }
     uint16_t crc = SpiCrcString((uint8_t*)&arm->rx1, SIZEOF_HEADER,0);
     if (crc != arm->rx1.crc) {
+        arm_link_update(arm, 1);
         pabort("Bad crc in one-phase operation");
         return -1;
     }
+    arm_link_update(arm, 0);
 
     if ((*((uint32_t*)&arm->rx1) & 0xffff00ff) == IDLE_PATTERN) { 
+        arm->int_status |= ach_header(&arm->rx1)->int_status;
         return 0;
     }
     if (arm->rx1.op == ARM_OP_WRITE_CHAR) { 
         // we received character from UART
-        // doplnit adresaci uartu &arm->uart_q[0..4]
-        queue_uart(arm->uart_q, ach_header(&arm->rx1)->ch1, ach_header(&arm->rx1)->len);
+        // char reply has no channel field, it is always sent for uart 0
+        arm->int_status |= ach_header(&arm->rx1)->int_status;
+        queue_uart(&arm->uart_q[0], ach_header(&arm->rx1)->ch1, ach_header(&arm->rx1)->len);
         return 0;
     }
     pabort("Unexpcted reply in one-phase operation");
@@ -159,7 +225,7 @@ int two_phase_op(arm_handle* arm, uint8_t op, uint16_t reg, uint16_t len2)
     arm->tx1.op = op;
     arm->tx1.reg = reg;
     arm->tx1.len = len2 & 0xff;        //set len in chunk1 to length of chunk2 (without crc)
-    arm->tr[1].delay_usecs = 25;              // set delay after first phase
+    arm->tr[1].delay_usecs = arm->phase_delay;    // set delay after first phase
     if (op != ARM_OP_WRITE_STR) {
         ac_header(arm->tx2)->op  = op;  // op and reg in chunk2 is the same
         ac_header(arm->tx2)->reg = reg;
@@ -176,32 +242,13 @@ int two_phase_op(arm_handle* arm, uint8_t op, uint16_t reg, uint16_t len2)
     ac_header(arm->rx2)->op  = op;                // 'destroy' content of receiving buffer
     uint32_t total = tr_len2 + CRC_SIZE;
 
-    if (total <= _MAX_SPI_RX) {
-        arm->tr[2].len = total;
-        ret = ioctl(arm->fd, SPI_IOC_MESSAGE(3), arm->tr);
-    } else if (total <= (2*_MAX_SPI_RX)) {
-        arm->tr[2].len = _MAX_SPI_RX;
-        arm->tr[3].len = total - _MAX_SPI_RX;
-        ret = ioctl(arm->fd, SPI_IOC_MESSAGE(4), arm->tr);
-    } else if (total <= (3*_MAX_SPI_RX)) {
-        arm->tr[2].len = _MAX_SPI_RX;
-        arm->tr[3].len = _MAX_SPI_RX;
-        arm->tr[4].len = total - (2*_MAX_SPI_RX);
-        ret = ioctl(arm->fd, SPI_IOC_MESSAGE(5), arm->tr);
-    } else if (total <= (4*_MAX_SPI_RX)) {
-        arm->tr[2].len = _MAX_SPI_RX;
-        arm->tr[3].len = _MAX_SPI_RX;
-        arm->tr[4].len = _MAX_SPI_RX;
-        arm->tr[5].len = total - (3*_MAX_SPI_RX);
-        ret = ioctl(arm->fd, SPI_IOC_MESSAGE(6), arm->tr);
-    } else {
-        arm->tr[2].len = _MAX_SPI_RX;
-        arm->tr[3].len = _MAX_SPI_RX;
-        arm->tr[4].len = _MAX_SPI_RX;
-        arm->tr[5].len = _MAX_SPI_RX;
-        arm->tr[6].len = total - (4*_MAX_SPI_RX);
-        ret = ioctl(arm->fd, SPI_IOC_MESSAGE(7), arm->tr);
+    int count = 2;
+    while (total > 0) {                           // chunks of second phase, up to tr[6]
+        uint32_t len = (total > arm->chunk) ? arm->chunk : total;
+        arm->tr[count++].len = len;
+        total -= len;
     }
+    ret = arm->trans->transfer(arm, arm->tr, count);
 
     //printf("ret2=%d\n", ret);
     if (ret < 1) {
@@ -214,16 +261,18 @@ int two_phase_op(arm_handle* arm, uint8_t op, uint16_t reg, uint16_t len2)
     //printf("rx1=%x\n", *((uint32_t*)&arm->rx1));
     crc = SpiCrcString((uint8_t*)&arm->rx1, SIZEOF_HEADER, 0);
     if (crc != arm->rx1.crc) {
+        arm_link_update(arm, 1);
         pabort("Bad 1.crc in two phase operation");
         return -1;
     }
 
     crc = SpiCrcString(arm->rx2, tr_len2, crc);
+    arm_link_update(arm, ((uint16_t*)arm->rx2)[tr_len2>>1] != crc);
 
     if (arm->rx1.op == ARM_OP_WRITE_CHAR) { 
-        // we received character from UART
-        // doplnit adresaci uartu!
-        queue_uart(arm->uart_q, ach_header(&arm->rx1)->ch1, ach_header(&arm->rx1)->len);
+        // we received character from UART (always uart 0)
+        arm->int_status |= ach_header(&arm->rx1)->int_status;
+        queue_uart(&arm->uart_q[0], ach_header(&arm->rx1)->ch1, ach_header(&arm->rx1)->len);
         if (((uint16_t*)arm->rx2)[tr_len2>>1] != crc) {
             pabort("Bad 2.crc in two phase operation");
             return -1;
@@ -235,6 +284,7 @@ int two_phase_op(arm_handle* arm, uint8_t op, uint16_t reg, uint16_t len2)
         return -1;
     }
     if ((*((uint32_t*)&arm->rx1) & 0xffff00ff) == IDLE_PATTERN) {
+        arm->int_status |= ach_header(&arm->rx1)->int_status;
         return 0;
     }
     sprintf(errmsg,"Unexpcted reply in two phase operation %02x %02x %04x %04x", 
@@ -252,7 +302,61 @@ int idle_op(arm_handle* arm)
     return n;
 }
 
-int read_regs(arm_handle* arm, uint16_t reg, uint8_t cnt, uint16_t* result)
+/* Cause of interrupt. Status comes in header of every reply, idle op
+   gets the latest one (and the first received char of uart 0) */
+int arm_int_status(arm_handle* arm)
+{
+    int status;
+
+    idle_op(arm);
+    status = arm->int_status;
+    arm->int_status = 0;
+    if (status & ARM_INT_DI_CHANGED) arm->int_di++;
+    if (status & ARM_INT_RX) arm->int_rx++;
+    if ((status & ARM_INT_MASK) == 0) arm->int_unknown++;
+    else arm->int_causes = 1;
+    return status;
+}
+
+int arm_refresh_di(arm_handle* arm)
+{
+    uint16_t value;
+    if (read_regs(arm, ARM_DI_REG, 1, &value) != 1) {
+        arm->di_valid = 0;
+        return -1;
+    }
+    arm->di_cache = value;
+    arm->di_updated = arm_now_ms();
+    arm->di_valid = 1;
+    return 0;
+}
+
+/* Digital inputs without spi transaction. Cache is used only on boards
+   with interrupt whose firmware has sent cause bits (DI change is known);
+   it is refreshed periodically in case of lost edge */
+int arm_cached_di(arm_handle* arm, uint16_t* value)
+{
+    if (!arm->di_valid || (arm->fdint < 0) || !arm->int_causes) return 0;
+    if (arm_now_ms() - arm->di_updated > ARM_DI_CACHE_AGE) {
+        if (arm_refresh_di(arm) < 0) return 0;
+    }
+    *value = arm->di_cache;
+    return 1;
+}
+
+/* Copy of registers with swapped bytes (board is little endian, modbus
+   big endian). One pass from spi buffer, no array of uint16 between */
+static void swap_copy(uint8_t* dst, const uint8_t* src, int cnt)
+{
+    int i;
+    for (i = 0; i < cnt * 2; i += 2) {
+        dst[i] = src[i+1];
+        dst[i+1] = src[i];
+    }
+}
+
+/* Read op, registers are left in rx2 after header. Returns count */
+static int read_regs_op(arm_handle* arm, uint16_t reg, uint8_t cnt)
 {
     uint16_t len2 = SIZEOF_HEADER + sizeof(uint16_t) * cnt;
     int ret = two_phase_op(arm, ARM_OP_READ_REG, reg, len2);
@@ -266,23 +370,42 @@ int read_regs(arm_handle* arm, uint16_t reg, uint8_t cnt, uint16_t* result)
             pabort("Unexpected reply in READ_REG");
             return -1;
     }
-    cnt =  ac_header(arm->rx2)->len;
-    memmove(result, arm->rx2+SIZEOF_HEADER, cnt * sizeof(uint16_t));
-    return cnt;
+    return ac_header(arm->rx2)->len;
 }
 
-int write_regs(arm_handle* arm, uint16_t reg, uint8_t cnt, uint16_t* values)
+int read_regs(arm_handle* arm, uint16_t reg, uint8_t cnt, uint16_t* result)
 {
-    if (cnt > 126) {
-        pabort("Too many registers in WRITE_REG");
-        return -1;
+    int n = read_regs_op(arm, reg, cnt);
+    if (n > 0) memmove(result, arm->rx2+SIZEOF_HEADER, n * sizeof(uint16_t));
+    return n;
+}
+
+/* Registers stored big endian straight into result (modbus response) */
+int read_regs_be(arm_handle* arm, uint16_t reg, uint8_t cnt, uint8_t* result)
+{
+    int n = read_regs_op(arm, reg, cnt);
+    if (n > 0) swap_copy(result, arm->rx2+SIZEOF_HEADER, n);
+    return n;
+}
+
+/* Drop cached values of written registers, cnt==0 drops all
+   (bits are mapped onto registers by firmware) */
+static void reg_cache_drop(arm_handle* arm, uint16_t reg, int cnt)
+{
+    int i;
+    for (i = 0; i < ARM_REG_CACHE; i++) {
+        if ((cnt == 0) || ((arm->reg_cache[i].reg >= reg) && (arm->reg_cache[i].reg < reg + cnt)))
+            arm->reg_cache[i].updated = 0;
     }
+}
 
+/* Write op of registers prepared in tx2 after header. Returns count */
+static int write_regs_op(arm_handle* arm, uint16_t reg, uint8_t cnt)
+{
     uint16_t len2 = SIZEOF_HEADER + sizeof(uint16_t) * cnt;
 
+    reg_cache_drop(arm, reg, cnt);
     ac_header(arm->tx2)->len = cnt;
-    memmove(arm->tx2 + SIZEOF_HEADER, values, cnt * sizeof(uint16_t));
-
     int ret = two_phase_op(arm, ARM_OP_WRITE_REG, reg, len2);
     if (ret < 0) {
         return ret;
@@ -296,6 +419,61 @@ int write_regs(arm_handle* arm, uint16_t reg, uint8_t cnt, uint16_t* values)
     return cnt;
 }
 
+int write_regs(arm_handle* arm, uint16_t reg, uint8_t cnt, uint16_t* values)
+{
+    if (cnt > 126) {
+        pabort("Too many registers in WRITE_REG");
+        return -1;
+    }
+    memmove(arm->tx2 + SIZEOF_HEADER, values, cnt * sizeof(uint16_t));
+    return write_regs_op(arm, reg, cnt);
+}
+
+/* Values taken big endian (modbus request) */
+int write_regs_be(arm_handle* arm, uint16_t reg, uint8_t cnt, uint8_t* values)
+{
+    if (cnt > 126) {
+        pabort("Too many registers in WRITE_REG");
+        return -1;
+    }
+    swap_copy(arm->tx2 + SIZEOF_HEADER, values, cnt);
+    return write_regs_op(arm, reg, cnt);
+}
+
+/* Read-modify-write of one register. Ops on board are serialised, so no
+   other master can write between read and write. Value written by the
+   previous mask write is used instead of read while it is fresh */
+int arm_mask_write(arm_handle* arm, uint16_t reg, uint16_t and_mask, uint16_t or_mask)
+{
+    arm_reg_entry* entry = NULL;
+    arm_reg_entry* oldest = &arm->reg_cache[0];
+    uint64_t now = arm_now_ms();
+    uint16_t value;
+    int i;
+
+    for (i = 0; i < ARM_REG_CACHE; i++) {
+        if (arm->reg_cache[i].updated && (arm->reg_cache[i].reg == reg)) 
+            entry = &arm->reg_cache[i];
+        if (arm->reg_cache[i].updated < oldest->updated) 
+            oldest = &arm->reg_cache[i];
+    }
+    arm->mask_writes++;
+    if ((entry != NULL) && (now - entry->updated <= ARM_REG_CACHE_AGE)) {
+        value = entry->value;
+        arm->mask_cached++;
+    } else if (read_regs(arm, reg, 1, &value) != 1) {
+        return -1;
+    }
+    value = (value & and_mask) | (or_mask & ~and_mask);
+    if (write_regs(arm, reg, 1, &value) != 1)
+        return -1;
+    if (entry == NULL) entry = oldest;
+    entry->reg = reg;
+    entry->value = value;
+    entry->updated = now;
+    return 1;
+}
+
 int read_bits(arm_handle* arm, uint16_t reg, uint16_t cnt, uint8_t* result)
 {
     uint16_t len2 = SIZEOF_HEADER + (((cnt+15) >> 4) << 1);  // trunc to 16bit in bytes
@@ -320,6 +498,7 @@ int read_bits(arm_handle* arm, uint16_t reg, uint16_t cnt, uint8_t* result)
 
 int write_bit(arm_handle* arm, uint16_t reg, uint8_t value)
 {
+    reg_cache_drop(arm, 0, 0);
     int ret = one_phase_op(arm, ARM_OP_WRITE_BIT, reg, !(!value));
     if (ret < 0) {
         return ret;
@@ -338,6 +517,7 @@ int write_bits(arm_handle* arm, uint16_t reg, uint16_t cnt, uint8_t* values)
     ac_header(arm->tx2)->len = cnt;
     memmove(arm->tx2 + SIZEOF_HEADER, values, ((cnt+7) >> 3));
 
+    reg_cache_drop(arm, 0, 0);
     int ret = two_phase_op(arm, ARM_OP_WRITE_BITS, reg, len2);
     if (ret < 0) {
         return ret;
@@ -355,16 +535,25 @@ int write_bits(arm_handle* arm, uint16_t reg, uint16_t cnt, uint8_t* values)
 
 int write_char(arm_handle* arm, uint8_t uart, uint8_t c)
 {
+    if (uart >= MAX_UARTS) {
+        pabort("Bad parameter uart");
+        return -1;
+    }
     int ret = one_phase_op(arm, ARM_OP_WRITE_CHAR, uart, c);
     if (ret < 0) {
         return ret;
     }
+    arm->uart_q[uart].tx_count++;
     return 1;
 }
 
 int write_string(arm_handle* arm, uint8_t uart, uint8_t* str, int len)
 {
 
+    if (uart >= MAX_UARTS) {
+        pabort("Bad parameter uart");
+        return -1;
+    }
     if ((len > 256) || (len<=0)) {
         pabort("Bad string length(1..256)");
         return -1;
@@ -374,26 +563,35 @@ int write_string(arm_handle* arm, uint8_t uart, uint8_t* str, int len)
     memmove(arm->tx2, str, len2);
 
     int ret = two_phase_op(arm, ARM_OP_WRITE_STR, uart, len2);
+    if (ret < 0) {
+        return ret;
+    }
 
     if (ac_header(arm->rx2)->op != ARM_OP_WRITE_STR) {
         pabort("Unexpcted reply in WRITE_STR");
         return -1;
     }
+    arm->uart_q[uart].tx_count += ac_header(arm->rx2)->len;
     return ac_header(arm->rx2)->len;
     //return cnt;
 }
 
-int read_string(arm_handle* arm, uint8_t uart, uint8_t* str, int cnt)
+/* Read up to cnt chars from remote uart queue into local ring.
+   Never asks for more than fits into the ring */
+int fetch_string(arm_handle* arm, uint8_t uart, int cnt)
 {
-    if (uart > 0) {
+    if (uart >= MAX_UARTS) {
         pabort("Bad parameter uart");
         return -1;
     }
     uart_queue* queue = &arm->uart_q[uart];
     uint16_t len2 = cnt;
+    uint32_t free = uq_free(queue) & ~1;             // board can return even count
 
     if (len2 % 2) len2++;
     if (len2 > SPI_STR_MAX) len2 = SPI_STR_MAX;
+    if (len2 > free) len2 = free;
+    if (len2 == 0) return 0;
     len2 = len2 + SIZEOF_HEADER;
 
     int ret =  two_phase_op(arm, ARM_OP_READ_STR, uart, len2);
@@ -409,79 +607,144 @@ int read_string(arm_handle* arm, uint8_t uart, uint8_t* str, int cnt)
     }
     uint16_t rcnt = acs_header(arm->rx2)->len;    // length of received string
     queue->remain = acs_header(arm->rx2)->remain; // remains in remote queue
-    // join uart_queue and rcnt chars
-    int n = queue->index < cnt ? queue->index : cnt;
-    if (n > 0) {
-        memmove(str, queue->buffer, n);
-        if (n < queue->index) {  // str is too short for import local queue
-            memmove(queue->buffer, queue->buffer + n, queue->index - n);
-            queue->index -= n;
-            if (queue->index + rcnt > MAX_LOCAL_QUEUE_LEN) 
-                rcnt = MAX_LOCAL_QUEUE_LEN - queue->index;
-            memmove(queue->buffer+queue->index, arm->rx2 + SIZEOF_HEADER, rcnt);
-            queue->index += rcnt;
-            return n;
-        }
-        queue->index = 0;
-        cnt -= n;
-    }
-    int n2 = rcnt < cnt ? rcnt : cnt;
-    memmove(str+n, arm->rx2 + SIZEOF_HEADER, n2);
-    if (rcnt > cnt) { // str is too short,  move rest of string to local queue
-        queue->index = rcnt - cnt;
-        if (queue->index > MAX_LOCAL_QUEUE_LEN) queue->index = MAX_LOCAL_QUEUE_LEN;
-        memmove(queue->buffer, arm->rx2 + SIZEOF_HEADER+cnt, queue->index);
+    queue->rx_count += rcnt;
+    uq_put(queue, arm->rx2 + SIZEOF_HEADER, rcnt);
+    return rcnt;
+}
+
+int read_string(arm_handle* arm, uint8_t uart, uint8_t* str, int cnt)
+{
+    int ret = fetch_string(arm, uart, cnt);
+    if (ret < 0) {
+        return ret;
     }
-    return n+n2;
+    return read_qstring(arm, uart, str, cnt);
 }
 
 int read_qstring(arm_handle* arm, uint8_t uart, uint8_t* str, int cnt)
 {
-    if (uart > 0) {
+    if (uart >= MAX_UARTS) {
         pabort("Bad parameter uart");
         return -1;
     }
     uart_queue* queue = &arm->uart_q[uart];
-    
-    // join uart_queue and rcnt chars
-    int n = queue->index < cnt ? queue->index : cnt;
-    if (n > 0) {
-        memmove(str, queue->buffer, n);
-        if (n < queue->index) {  // str is too short for import local queue
-            memmove(queue->buffer, queue->buffer + n, queue->index - n);
-            queue->index -= n;
-            return n;
-        }
-        queue->index = 0;
-        return n;
+    uint8_t* data;
+    int n = 0;
+    int len;
+
+    // ring can be wrapped - max two parts
+    while ((n < cnt) && ((len = uq_peek(queue, &data)) > 0)) {
+        if (len > cnt - n) len = cnt - n;
+        memcpy(str + n, data, len);
+        uq_consume(queue, len);
+        n += len;
+    }
+    return n;
+}
+
+void arm_free_queues(arm_handle* arm)
+{
+    int i;
+    for (i=0; i< MAX_UARTS; i++) {
+        free(arm->uart_q[i].ring);
+        arm->uart_q[i].ring = NULL;
     }
-    return 0;
 }
 
 
 //const char* GPIO_INT[] = { "27", "23", "22" };
 #define START_SPI_SPEED 5000000
-int arm_init(arm_handle* arm, const char* device, uint32_t speed, int index, const char* gpio)
+
+/* Interrupt gpio as line event of gpio character device.
+   gpio is "offset" on gpiochip0 or "gpiochipN:offset" */
+static int arm_open_gpio_cdev(arm_handle* arm, const char* gpio)
+{
+    struct gpioevent_request req;
+    char chipname[64] = "/dev/gpiochip0";
+    const char* p = strchr(gpio, ':');
+    int fdx;
+
+    if (p != NULL) {
+        if ((p - gpio) > 32) return -1;
+        sprintf(chipname, "/dev/%.*s", (int)(p - gpio), gpio);
+        p++;
+    } else {
+        p = gpio;
+    }
+    fdx = open(chipname, O_RDONLY);
+    if (fdx < 0) return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.lineoffset = atoi(p);
+    req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+    req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+    strcpy(req.consumer_label, "neuron_tcp_server");
+    if (ioctl(fdx, GPIO_GET_LINEEVENT_IOCTL, &req) < 0) {
+        close(fdx);
+        return -1;
+    }
+    close(fdx);
+    arm->fdint = req.fd;
+    arm->intcdev = 1;
+    return 0;
+}
+
+/* Deprecated sysfs interface, for kernels without gpio chardev */
+static int arm_open_gpio_sysfs(arm_handle* arm, const char* gpio)
 {
-    arm->fd = open(device, O_RDWR);
+    int fdx = open("/sys/class/gpio/export", O_WRONLY);
+    if (fdx < 0) return -1;
+    write(fdx, gpio, strlen(gpio));
+    close(fdx);
+
+    char gpiobuf[256];
+    sprintf(gpiobuf, "/sys/class/gpio/gpio%s/edge", gpio);
+    fdx = open(gpiobuf, O_WRONLY);
+    if (fdx < 0) return -1;
+    write(fdx, "rising", 6);
+    close(fdx);
 
-    if (arm->fd < 0) {
+    sprintf(gpiobuf, "/sys/class/gpio/gpio%s/value", gpio);
+    arm->fdint = open(gpiobuf, O_RDONLY);
+    if (arm->fdint < 0) return -1;
+    arm->intcdev = 0;
+    return 0;
+}
+
+int arm_init(arm_handle* arm, const char* device, uint32_t speed, int index, const char* gpio)
+{
+    arm->index = index;
+    if (arm_transport_open(arm, device) < 0) {
         pabort("Cannot open device");
         return -1;
     }
     //set_spi_mode(fd,0);
     if (speed==0) {
-        set_spi_speed(arm->fd, START_SPI_SPEED);
+        arm->trans->set_speed(arm, START_SPI_SPEED);
     } else {
-        set_spi_speed(arm->fd, speed);
+        arm->trans->set_speed(arm, speed);
     }
-    arm->index = index;
+    arm->link_hold = 1;
+    arm->link_xfers = arm->link_errors = arm->link_rate = 0;
+    arm->crc_errors = arm->speed_down = arm->speed_up = 0;
+    memset(arm->reg_cache, 0, sizeof(arm->reg_cache));
+    arm->mask_writes = arm->mask_cached = 0;
 
     int i;
-    for (i=0; i< 4; i++) {
+    uint32_t qsize = 1;
+    while (qsize < uart_queue_len) qsize <<= 1;     // ring size must be power of two
+    for (i=0; i< MAX_UARTS; i++) {
+       memset(&arm->uart_q[i], 0, sizeof(uart_queue));
        arm->uart_q[i].masterpty = -1;
-       arm->uart_q[i].remain = 0;
-       arm->uart_q[i].index = 0;
+       arm->uart_q[i].sockfd = -1;
+       arm->uart_q[i].line = -1;
+       arm->uart_q[i].size = qsize;
+       arm->uart_q[i].ring = malloc(qsize);
+       if (arm->uart_q[i].ring == NULL) {
+           arm_free_queues(arm);
+           arm_transport_close(arm);
+           return -1;
+       }
     }
     // Prepare transactional structure
     memset(arm->tr, 0, sizeof(arm->tr));
@@ -489,16 +752,7 @@ int arm_init(arm_handle* arm, const char* device, uint32_t speed, int index, con
     arm->tr[1].tx_buf = (unsigned long) &arm->tx1;
     arm->tr[1].rx_buf = (unsigned long) &arm->rx1;
     arm->tr[1].len = SNIPLEN1;
-    arm->tr[2].tx_buf = (unsigned long) arm->tx2;
-    arm->tr[2].rx_buf = (unsigned long) arm->rx2;
-    arm->tr[3].tx_buf = (unsigned long) arm->tx2 + _MAX_SPI_RX;
-    arm->tr[3].rx_buf = (unsigned long) arm->rx2 + _MAX_SPI_RX;
-    arm->tr[4].tx_buf = (unsigned long) arm->tx2 + (_MAX_SPI_RX*2);
-    arm->tr[4].rx_buf = (unsigned long) arm->rx2 + (_MAX_SPI_RX*2);
-    arm->tr[5].tx_buf = (unsigned long) arm->tx2 + (_MAX_SPI_RX*3);
-    arm->tr[5].rx_buf = (unsigned long) arm->rx2 + (_MAX_SPI_RX*3);
-    arm->tr[6].tx_buf = (unsigned long) arm->tx2 + (_MAX_SPI_RX*4);
-    arm->tr[6].rx_buf = (unsigned long) arm->rx2 + (_MAX_SPI_RX*4);
+    arm_set_timing(arm, ARM_CHUNK_DEFAULT, ARM_PHASE_DELAY);
     /* Load firmware and hardware versions */
     int backup = arm_verbose;
     arm_verbose = 0;
@@ -506,14 +760,19 @@ int arm_init(arm_handle* arm, const char* device, uint32_t speed, int index, con
     if (read_regs(arm, 1000, 5, configregs) == 5)
         parse_version(&arm->bv, configregs);
     //arm_version(arm);
+    arm->max_speed = speed;
     if (speed == 0) {
         speed = get_board_speed(&arm->bv);
-        set_spi_speed(arm->fd, speed);
+        arm->max_speed = speed;
+        arm->trans->set_speed(arm, speed);
         if (read_regs(arm, 1000, 5, configregs) != 5) {
-            set_spi_speed(arm->fd, START_SPI_SPEED);
+            arm->trans->set_speed(arm, START_SPI_SPEED);
             speed = START_SPI_SPEED;
         }
     }
+    arm->speed = speed;
+    arm->link_clean = arm_now_ms();
+    arm->link_hold = 0;
     arm_verbose = backup;
     if (arm->bv.sw_version) {
         if (arm_verbose) 
@@ -522,34 +781,203 @@ int arm_init(arm_handle* arm, const char* device, uint32_t speed, int index, con
                 HW_BOARD(arm->bv.hw_version), HW_MAJOR(arm->bv.hw_version),
                 arm_name(arm->bv.hw_version), speed / 1000000);
     } else {
-        close(arm->fd);
+        arm_free_queues(arm);
+        arm_transport_close(arm);
         return -1;
     }
 
     /* Open fdint for interrupt catcher */
     arm->fdint = -1;
+    arm->polltimer = -1;
 
     if ((gpio == NULL)||(strlen(gpio) == 0)||(arm->bv.int_mask_register<=0)) return 0;
 
-    int fdx = open("/sys/class/gpio/export", O_WRONLY);
-    if (fdx < 0) return 0;
-    write(fdx, gpio, strlen(gpio));
-    close(fdx);
+    if (arm_open_gpio_cdev(arm, gpio) < 0)
+        arm_open_gpio_sysfs(arm, gpio);
+    return 0;
+}
 
-    char gpiobuf[256];
-    sprintf(gpiobuf, "/sys/class/gpio/gpio%s/edge", gpio);
-    fdx = open(gpiobuf, O_WRONLY);
-    if (fdx < 0) return 0;
-    write(fdx, "rising", 6);
-    close(fdx);
+/* Chunk length and pause after header phase used by two_phase_op */
+void arm_set_timing(arm_handle* arm, uint16_t chunk, uint16_t phase_delay)
+{
+    int i;
+    if (chunk < ARM_CHUNK_DEFAULT) chunk = ARM_CHUNK_DEFAULT;   // 5 chunks must hold the longest frame
+    if (chunk > ARM_CHUNK_MAX) chunk = ARM_CHUNK_MAX;
+    arm->chunk = chunk;
+    arm->phase_delay = phase_delay;
+    for (i = 2; i < 7; i++) {
+        arm->tr[i].tx_buf = (unsigned long) arm->tx2 + chunk * (i-2);
+        arm->tr[i].rx_buf = (unsigned long) arm->rx2 + chunk * (i-2);
+    }
+}
 
-    sprintf(gpiobuf, "/sys/class/gpio/gpio%s/value", gpio);
-    arm->fdint = open(gpiobuf, O_RDONLY);
-    if (arm->fdint < 0) return 0;
+#define ARM_CALIB_REGS    120           // long read, crosses chunks unless chunk >= 246
+#define ARM_CALIB_BURST   20            // reads which must pass without error
+#define ARM_CALIB_MARGIN  2             // [us] added to minimal working delay
 
+/* Burst of long reads of version registers with given timing */
+static int calib_probe(arm_handle* arm, uint16_t chunk, uint16_t phase_delay)
+{
+    uint16_t regs[ARM_CALIB_REGS];
+    int i;
+
+    arm_set_timing(arm, chunk, phase_delay);
+    for (i = 0; i < ARM_CALIB_BURST; i++) {
+        if ((read_regs(arm, 1000, ARM_CALIB_REGS, regs) < 5) ||
+            (regs[0] != arm->bv.sw_version) || (regs[3] != arm->bv.hw_version))
+            return 0;
+    }
+    return 1;
+}
+
+/* Find the longest chunk and the shortest pause after header phase the
+   board handles reliably. Default timing is kept if it does not pass itself */
+int arm_calibrate(arm_handle* arm)
+{
+    int lo, hi, mid;
+    int backup = arm_verbose;
+
+    arm_verbose = 0;
+    arm->link_hold = 1;                        // errors are expected here
+    uint32_t crc_errors = arm->crc_errors;
+    if (!calib_probe(arm, ARM_CHUNK_DEFAULT, ARM_PHASE_DELAY)) {
+        arm_set_timing(arm, ARM_CHUNK_DEFAULT, ARM_PHASE_DELAY);
+        arm->crc_errors = crc_errors;
+        arm->link_hold = 0;
+        arm_verbose = backup;
+        return -1;
+    }
+    lo = ARM_CHUNK_DEFAULT; hi = ARM_CHUNK_MAX;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (calib_probe(arm, mid, ARM_PHASE_DELAY)) lo = mid; else hi = mid - 1;
+    }
+    int chunk = lo;
+    lo = 0; hi = ARM_PHASE_DELAY;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (calib_probe(arm, chunk, mid)) hi = mid; else lo = mid + 1;
+    }
+    hi += ARM_CALIB_MARGIN;
+    if (hi > ARM_PHASE_DELAY) hi = ARM_PHASE_DELAY;
+    arm_set_timing(arm, chunk, hi);
+    arm->link_xfers = arm->link_errors = 0;
+    arm->crc_errors = crc_errors;
+    arm->link_hold = 0;
+    arm_verbose = backup;
+    if (arm_verbose)
+        printf("Board%d calibrated chunk=%d delay=%dus\n", arm->index, arm->chunk, arm->phase_delay);
     return 0;
 }
 
+/* Timing depends on board and on SoC of the master. Calibration file has
+   lines "soc hw_version chunk delay" */
+static const char* arm_soc(void)
+{
+    static char soc[64];
+    char buf[512];
+    FILE* f;
+    int n, i;
+
+    if (soc[0]) return soc;
+    strcpy(soc, "unknown");
+    f = fopen("/proc/device-tree/compatible", "r");
+    if (f != NULL) {
+        // list of zero terminated strings, the last one names the soc
+        n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        if (n > 0) {
+            buf[n] = '\0';
+            for (i = n - 1; (i > 0) && (buf[i-1] != '\0'); i--);
+            if (buf[i]) snprintf(soc, sizeof(soc), "%s", buf + i);
+        }
+        return soc;
+    }
+    f = fopen("/proc/cpuinfo", "r");
+    if (f == NULL) return soc;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        if (sscanf(buf, "Hardware : %63s", soc) == 1) break;
+    }
+    fclose(f);
+    return soc;
+}
+
+/* Returns 1 if timing of the board was found in file */
+int arm_load_timing(arm_handle* arm, const char* filename)
+{
+    char line[256], soc[64];
+    unsigned int hw, chunk, delay;
+    FILE* f = fopen(filename, "r");
+    int found = 0;
+
+    if (f == NULL) return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%63s %x %u %u", soc, &hw, &chunk, &delay) != 4) continue;
+        if ((strcmp(soc, arm_soc()) == 0) && (hw == arm->bv.hw_version)) {
+            arm_set_timing(arm, chunk, delay);
+            found = 1;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+/* Store timing of the board, replaces older line of the same soc and board */
+int arm_save_timing(arm_handle* arm, const char* filename)
+{
+    char line[256], soc[64], tmpname[256];
+    unsigned int hw;
+    FILE *f, *fo;
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    fo = fopen(tmpname, "w");
+    if (fo == NULL) return -1;
+    f = fopen(filename, "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if ((sscanf(line, "%63s %x", soc, &hw) == 2) &&
+                (strcmp(soc, arm_soc()) == 0) && (hw == arm->bv.hw_version))
+                continue;
+            fputs(line, fo);
+        }
+        fclose(f);
+    }
+    fprintf(fo, "%s %04x %u %u\n", arm_soc(), arm->bv.hw_version, arm->chunk, arm->phase_delay);
+    if (fclose(fo) != 0) return -1;
+    return rename(tmpname, filename);
+}
+
+/* Consume interrupt notification on fdint, returns count of edges */
+int arm_read_int(arm_handle* arm)
+{
+    struct gpioevent_data ev[16];
+    struct timespec ts;
+    uint16_t intval;
+    int i, n;
+
+    if (!arm->intcdev) {
+        pread(arm->fdint, &intval, 2, 0); // read 2 bytes value of gpio - should be 1
+        arm->int_count++;
+        return 1;
+    }
+    n = read(arm->fdint, ev, sizeof(ev));
+    if (n < (int) sizeof(ev[0])) return 0;
+    n /= sizeof(ev[0]);
+    // line event timestamps are CLOCK_MONOTONIC since linux 5.7
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    for (i = 0; i < n; i++) {
+        arm->int_count++;
+        if (ev[i].timestamp > now) continue;
+        uint64_t latency = (now - ev[i].timestamp) / 1000;
+        if (latency > 10000000) continue;      // realtime stamps of older kernels
+        arm->int_stamped++;
+        arm->int_latency_sum += latency;
+        if (latency > arm->int_latency_max) arm->int_latency_max = latency;
+    }
+    return n;
+}
+
 /***************************************************************************************/
 
 typedef struct {
@@ -562,7 +990,7 @@ typedef struct {
 int firmware_op(arm_handle* arm, arm_comm_firmware* tx, arm_comm_firmware* rx, int tr_len, struct spi_ioc_transfer* tr)
 {
     tx->crc = SpiCrcString((uint8_t*)tx, sizeof(arm_comm_firmware) - sizeof(tx->crc), 0);
-    int ret = ioctl(arm->fd, SPI_IOC_MESSAGE(tr_len), tr);
+    int ret = arm->trans->transfer(arm, tr, tr_len);
     if (ret < 1) {
         pabort("Can't send firmware-op spi message");
         return -1;
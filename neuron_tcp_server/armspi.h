@@ -15,6 +15,25 @@
 #include <linux/spi/spidev.h>
 #include "armutil.h"
 
+// brain/modbus_prot.h
+#define ARM_OP_READ_BIT   1
+#define ARM_OP_READ_REG   4
+#define ARM_OP_WRITE_BIT  5
+#define ARM_OP_WRITE_REG  6
+#define ARM_OP_WRITE_BITS 15
+
+#define ARM_OP_WRITE_CHAR  65
+#define ARM_OP_WRITE_STR   100
+#define ARM_OP_READ_STR    101
+
+#define ARM_OP_IDLE        0xfa
+
+#define IDLE_PATTERN 0x0e5500fa
+
+#define ac_header(buf) ((arm_comm_header*)buf)
+#define ach_header(buf) ((arm_comm_chr_header*)buf)
+#define acs_header(buf) ((arm_comm_str_header*)buf)
+
 // brain/spi.h
 // Structures for communication header
 typedef struct {
@@ -61,40 +80,140 @@ typedef struct {
 #define SNIPLEN2       256 // Max size of second chunk - DOCISTIT (255?, 256?, 256 + header!!!)
 #define CRC_SIZE       2
 
-#define MAX_LOCAL_QUEUE_LEN 256
+// hodnota 240 znaku by pravdepodobne mela byt spise 
+//    255 - sizeof(arm_comm_header) = 251 -> 250(sude cislo) znaku 
+// vyzkouset jestli neni problem v firmware
+#define SPI_STR_MAX 240
+
+// Interrupt cause bits (int_status in reply header), mask register uses the same
+#define ARM_INT_DI_CHANGED  0x01        // digital inputs changed
+#define ARM_INT_RX          0x04        // uart has received chars
+#define ARM_INT_MASK        (ARM_INT_DI_CHANGED | ARM_INT_RX)
+
+#define ARM_DI_REG          0           // register with digital inputs
+#define ARM_DI_CACHE_AGE    1000        // [ms] cached inputs are read again after
+#define ARM_REG_CACHE       8           // registers remembered after mask write
+#define ARM_REG_CACHE_AGE   1000        // [ms]
+
+// Timing of two phase op, defaults fit the slowest Pi and board
+#define ARM_CHUNK_DEFAULT   64          // max length of spi transfer (RPi 2,3 fails above 94)
+#define ARM_CHUNK_MAX       256
+#define ARM_PHASE_DELAY     25          // [us] pause after header phase
+
+// Spi clock management by crc errors
+#define ARM_LINK_WINDOW     256         // transfers in one window
+#define ARM_LINK_BURST      3           // crc errors in window which step speed down
+#define ARM_LINK_CLEAN      60000       // [ms] without error before speed is probed up
+#define ARM_LINK_MIN_SPEED  1000000
+
+#define MAX_LOCAL_QUEUE_LEN 256         // default capacity of uart receive ring
+#define MAX_UARTS           4
+
+/* Single producer (spi ops) / single consumer (pty) ring buffer.
+   head and tail are free running counters, size is power of two */
 typedef struct {
-    int index;
-    uint8_t buffer[MAX_LOCAL_QUEUE_LEN];
+    uint8_t* ring;
+    uint32_t size;
+    uint32_t head;                     // written by producer
+    uint32_t tail;                     // written by consumer
     int remain;
     int overflow;
     int masterpty;
+    int sockfd;                        // raw tcp client, replaces pty while connected
+    int line;                          // global index as in /dev/extcomm/0/x
+    uint32_t latency;                  // [us] max delay of received chars on polled board
+    void* gateway;                     // rtu_channel if uart is used by modbus gateway
+    uint8_t txbuf[SPI_STR_MAX];        // chars waiting for write_string
+    int txlen;
+    int txwait;                        // input is not read until txbuf is sent
+    // statistics
+    uint32_t rx_count;
+    uint32_t tx_count;
 } uart_queue;
 
+#define uq_used(q)   ((q)->head - (q)->tail)
+#define uq_free(q)   ((q)->size - uq_used(q))
+
+typedef struct {
+    uint16_t reg;
+    uint16_t value;
+    uint64_t updated;                  // [ms] monotonic, 0 = free
+} arm_reg_entry;
+
+typedef struct _arm_transport arm_transport;
 
 typedef struct {
     int fd;
+    const arm_transport* trans;        // spidev, simulator, ...
+    void* trans_data;
     int fdint;
+    int intcdev;                       // fdint is line event fd of gpio chardev (else sysfs value)
+    uint32_t int_count;                // interrupt edges
+    uint32_t int_latency_max;          // [us] edge timestamp -> handling
+    uint64_t int_latency_sum;
+    uint32_t int_stamped;              // edges counted in latency
+    uint8_t int_status;                // cause bits collected from replies
+    uint32_t int_di;                   // interrupts by cause
+    uint32_t int_rx;
+    uint32_t int_unknown;
+    int int_causes;                    // firmware sends cause bits, DI cache can be used
+    uint16_t di_cache;                 // digital inputs, kept fresh by DI interrupt
+    int di_valid;
+    uint64_t di_updated;               // [ms] monotonic
+    arm_reg_entry reg_cache[ARM_REG_CACHE]; // values written by mask write
+    uint32_t mask_writes;
+    uint32_t mask_cached;              // mask writes without read
+    int polltimer;                     // timerfd for uart polling if board has no interrupt
+    uint32_t poll_interval;            // [us] current polling period
     int index;
     arm_comm_header_crc tx1;
     arm_comm_header_crc rx1;
     uint8_t tx2[SNIPLEN2 + CRC_SIZE + 40];
     uint8_t rx2[SNIPLEN2 + CRC_SIZE + 40];
     struct spi_ioc_transfer tr[7];     // Transaction structure for 5 chunks
+    uint32_t speed;                    // current spi clock
+    uint32_t max_speed;                // configured or by board version
+    int link_hold;                     // speed is not changed (init, calibration)
+    uint32_t link_xfers;               // transfers in current window
+    uint32_t link_errors;              // crc errors in current window
+    uint32_t link_rate;                // smoothed crc error rate [ppm]
+    uint64_t link_clean;               // [ms] last error or speed change
+    uint32_t crc_errors;
+    uint32_t speed_down;
+    uint32_t speed_up;
+    uint16_t chunk;                    // length of second phase chunk
+    uint16_t phase_delay;              // [us] pause after header phase
     Tboard_version bv;
-    uart_queue uart_q[4];              // local queue for uarts on arm
+    uart_queue uart_q[MAX_UARTS];      // local queue for uarts on arm
 }  arm_handle;
 
 
 int arm_init(arm_handle* arm, const char* device, uint32_t speed, int index, const char* gpio);
+int arm_read_int(arm_handle* arm);
+void arm_set_timing(arm_handle* arm, uint16_t chunk, uint16_t phase_delay);
+int arm_calibrate(arm_handle* arm);
+int arm_load_timing(arm_handle* arm, const char* filename);
+int arm_save_timing(arm_handle* arm, const char* filename);
+int arm_int_status(arm_handle* arm);
+int arm_refresh_di(arm_handle* arm);
+int arm_cached_di(arm_handle* arm, uint16_t* value);
 int idle_op(arm_handle* arm);
 int read_regs(arm_handle* arm, uint16_t reg, uint8_t cnt, uint16_t* result);
 int write_regs(arm_handle* arm, uint16_t reg, uint8_t cnt, uint16_t* values);
+int read_regs_be(arm_handle* arm, uint16_t reg, uint8_t cnt, uint8_t* result);
+int write_regs_be(arm_handle* arm, uint16_t reg, uint8_t cnt, uint8_t* values);
 int read_bits(arm_handle* arm, uint16_t reg, uint16_t cnt, uint8_t* result);
 int write_bit(arm_handle* arm, uint16_t reg, uint8_t value);
 int write_bits(arm_handle* arm, uint16_t reg, uint16_t cnt, uint8_t* values);
+int arm_mask_write(arm_handle* arm, uint16_t reg, uint16_t and_mask, uint16_t or_mask);
 int write_char(arm_handle* arm, uint8_t uart, uint8_t c);
 int write_string(arm_handle* arm, uint8_t uart, uint8_t* str, int len);
 int read_string(arm_handle* arm, uint8_t uart, uint8_t* str, int cnt);
+int read_qstring(arm_handle* arm, uint8_t uart, uint8_t* str, int cnt);
+int fetch_string(arm_handle* arm, uint8_t uart, int cnt);
+int uq_peek(uart_queue* queue, uint8_t** str);
+void uq_consume(uart_queue* queue, int cnt);
+void arm_free_queues(arm_handle* arm);
 
 //const char* arm_name(arm_handle* arm);
 
@@ -105,5 +224,6 @@ void finish_firmware(void*  ctx);
 //int send_firmware(arm_handle* arm, uint8_t* data, size_t datalen, uint32_t start_address);
 extern int arm_verbose;
 extern int nss_pause;
+extern uint32_t uart_queue_len;
 
 #endif
@@ -0,0 +1,643 @@
+/*
+ * Transports carrying SPI frames of UniPi Neuron family controllers
+ *
+ * spidev    - real board on SPI bus
+ * simulator - board in process (registers, bits, uarts in loopback),
+ *             upper layers can be run and benchmarked without hardware
+ * unix      - frames are forwarded to local socket (remote board or
+ *             external simulator)
+ * replay    - replies come from trace captured on real board; timing
+ *             problems can be reproduced and upper layers measured
+ * capture   - wraps any transport and writes every transfer to trace
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/spi/spidev.h>
+
+#include "armtrans.h"
+#include "spicrc.h"
+
+/***************************************************************************************/
+/* spidev */
+
+static int spidev_open(arm_handle* arm, const char* path)
+{
+    arm->fd = open(path, O_RDWR);
+    return (arm->fd < 0) ? -1 : 0;
+}
+
+static int spidev_transfer(arm_handle* arm, struct spi_ioc_transfer* tr, int count)
+{
+    return ioctl(arm->fd, SPI_IOC_MESSAGE(count), tr);
+}
+
+static int spidev_set_speed(arm_handle* arm, uint32_t speed)
+{
+    return ioctl(arm->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+}
+
+static void spidev_close(arm_handle* arm)
+{
+    close(arm->fd);
+    arm->fd = -1;
+}
+
+static const arm_transport spidev_transport = {
+    "spidev", spidev_open, spidev_transfer, spidev_set_speed, spidev_close
+};
+
+/***************************************************************************************/
+/* simulator */
+
+typedef struct {
+    uint16_t regs[ARMSIM_REGS];
+    uint8_t uart[MAX_UARTS][ARMSIM_UART_BUF];   // written chars come back (loopback)
+    int uart_len[MAX_UARTS];
+    uint8_t int_status;
+} arm_sim;
+
+static int sim_open(arm_handle* arm, const char* path)
+{
+    arm_sim* sim = calloc(1, sizeof(arm_sim));
+    if (sim == NULL) return -1;
+    sim->regs[1000] = 0x0504;                          // firmware 5.4
+    sim->regs[1001] = 0x0404;                          // 4 DI, 4 DO
+    sim->regs[1002] = 0x0111;                          // 1 AI, 1 AO, 1 uart
+    sim->regs[1003] = (*path) ? strtol(path, NULL, 16) : 0;
+    sim->regs[1004] = sim->regs[1003];
+    arm->trans_data = sim;
+    arm->fd = -1;
+    return 0;
+}
+
+static int sim_get_bit(arm_sim* sim, uint32_t bit)
+{
+    return (sim->regs[(bit >> 4) % ARMSIM_REGS] >> (bit & 15)) & 1;
+}
+
+static void sim_set_bit(arm_sim* sim, uint32_t bit, int value)
+{
+    uint16_t* reg = &sim->regs[(bit >> 4) % ARMSIM_REGS];
+    if (value) *reg |= 1 << (bit & 15);
+    else       *reg &= ~(1 << (bit & 15));
+}
+
+/* Returns count of chars accepted, as board does when its queue is full */
+static int sim_uart_put(arm_sim* sim, uint8_t uart, uint8_t* str, int len)
+{
+    if (uart >= MAX_UARTS) return 0;
+    if (len > ARMSIM_UART_BUF - sim->uart_len[uart]) len = ARMSIM_UART_BUF - sim->uart_len[uart];
+    memcpy(sim->uart[uart] + sim->uart_len[uart], str, len);
+    sim->uart_len[uart] += len;
+    if (len > 0) sim->int_status |= ARM_INT_RX;
+    return len;
+}
+
+static int sim_uart_get(arm_sim* sim, uint8_t uart, uint8_t* str, int len)
+{
+    if (len > sim->uart_len[uart]) len = sim->uart_len[uart];
+    memcpy(str, sim->uart[uart], len);
+    memmove(sim->uart[uart], sim->uart[uart] + len, sim->uart_len[uart] - len);
+    sim->uart_len[uart] -= len;
+    return len;
+}
+
+/* Second phase: tx2 is request, rx2 gets reply (header + data), both len2 long */
+static void sim_phase2(arm_sim* sim, arm_comm_header* hdr, uint8_t* tx2, uint8_t* rx2, int len2)
+{
+    arm_comm_header* rhdr = (arm_comm_header*) rx2;
+    uint8_t* data = rx2 + SIZEOF_HEADER;
+    int i, cnt;
+
+    rhdr->op = hdr->op;
+    rhdr->reg = hdr->reg;
+    rhdr->len = 0;
+    switch (hdr->op) {
+    case ARM_OP_READ_REG:
+        cnt = (len2 - SIZEOF_HEADER) / 2;
+        if (hdr->reg + cnt > ARMSIM_REGS) break;
+        memcpy(data, sim->regs + hdr->reg, cnt * 2);
+        rhdr->len = cnt;
+        break;
+    case ARM_OP_WRITE_REG:
+        cnt = ac_header(tx2)->len;
+        if (hdr->reg + cnt > ARMSIM_REGS) break;
+        memcpy(sim->regs + hdr->reg, tx2 + SIZEOF_HEADER, cnt * 2);
+        rhdr->len = cnt;
+        break;
+    case ARM_OP_READ_BIT:
+        cnt = (len2 - SIZEOF_HEADER) * 8;
+        if (cnt > 255) cnt = 255;
+        for (i = 0; i < cnt; i++) {
+            if (sim_get_bit(sim, hdr->reg + i)) data[i >> 3] |= 1 << (i & 7);
+        }
+        rhdr->len = cnt;
+        break;
+    case ARM_OP_WRITE_BITS:
+        cnt = ac_header(tx2)->len;
+        for (i = 0; i < cnt; i++) {
+            sim_set_bit(sim, hdr->reg + i, (tx2[SIZEOF_HEADER + (i >> 3)] >> (i & 7)) & 1);
+        }
+        rhdr->len = cnt;
+        break;
+    case ARM_OP_WRITE_STR:
+        cnt = hdr->len ? hdr->len : 256;
+        rhdr->len = sim_uart_put(sim, hdr->reg, tx2, cnt);
+        break;
+    case ARM_OP_READ_STR: {
+        uint8_t uart = hdr->reg;
+        if (uart >= MAX_UARTS) break;
+        cnt = sim_uart_get(sim, uart, data, len2 - SIZEOF_HEADER);
+        acs_header(rx2)->len = cnt;
+        acs_header(rx2)->channel = uart;
+        acs_header(rx2)->remain = (sim->uart_len[uart] > 255) ? 255 : sim->uart_len[uart];
+        break;
+    }
+    }
+}
+
+static int sim_transfer(arm_handle* arm, struct spi_ioc_transfer* tr, int count)
+{
+    arm_sim* sim = arm->trans_data;
+    arm_comm_header_crc* tx1 = (arm_comm_header_crc*) (unsigned long) tr[1].tx_buf;
+    arm_comm_header_crc* rx1 = (arm_comm_header_crc*) (unsigned long) tr[1].rx_buf;
+    uint8_t tx2[SNIPLEN2 + CRC_SIZE + 40];
+    uint8_t rx2[SNIPLEN2 + CRC_SIZE + 40];
+    uint16_t crc;
+    int i, len, pos;
+
+    if ((count < 2) || (tr[1].len != SNIPLEN1)) return -1;       // firmware ops are not simulated
+    if (SpiCrcString((uint8_t*) tx1, SIZEOF_HEADER, 0) != tx1->crc) {
+        memset(rx1, 0, SNIPLEN1);
+        return count;
+    }
+
+    /* first phase */
+    if ((count == 2) && (sim->uart_len[0] > 0)) {
+        // chars of uart 0 are sent in reply to one-phase ops
+        ach_header(rx1)->op = ARM_OP_WRITE_CHAR;
+        ach_header(rx1)->int_status = sim->int_status;
+        ach_header(rx1)->len = (sim->uart_len[0] >= 256) ? 0 : sim->uart_len[0];
+        sim_uart_get(sim, 0, &ach_header(rx1)->ch1, 1);
+    } else {
+        *((uint32_t*) rx1) = IDLE_PATTERN;
+        ach_header(rx1)->int_status = sim->int_status;
+    }
+    sim->int_status = 0;
+    rx1->crc = SpiCrcString((uint8_t*) rx1, SIZEOF_HEADER, 0);
+
+    if (count == 2) {
+        switch (tx1->op) {
+        case ARM_OP_WRITE_BIT:
+            sim_set_bit(sim, tx1->reg, tx1->len);
+            break;
+        case ARM_OP_WRITE_CHAR:
+            sim_uart_put(sim, tx1->reg, &tx1->len, 1);
+            break;
+        }
+        return count;
+    }
+
+    /* second phase - gather chunks */
+    for (i = 2, len = 0; i < count; i++) {
+        if (len + tr[i].len > sizeof(tx2)) return -1;
+        memcpy(tx2 + len, (void*) (unsigned long) tr[i].tx_buf, tr[i].len);
+        len += tr[i].len;
+    }
+    memset(rx2, 0, len);
+    len -= CRC_SIZE;
+    crc = SpiCrcString(tx2, len, tx1->crc);
+    if ((len >= (int) SIZEOF_HEADER) && (crc == *(uint16_t*) (tx2 + len))) {
+        sim_phase2(sim, (arm_comm_header*) tx1, tx2, rx2, len);
+    }
+    *(uint16_t*) (rx2 + len) = SpiCrcString(rx2, len, rx1->crc);
+    for (i = 2, pos = 0; i < count; i++) {
+        memcpy((void*) (unsigned long) tr[i].rx_buf, rx2 + pos, tr[i].len);
+        pos += tr[i].len;
+    }
+    return count;
+}
+
+static int sim_set_speed(arm_handle* arm, uint32_t speed)
+{
+    (void) arm;
+    (void) speed;
+    return 0;
+}
+
+static void sim_close(arm_handle* arm)
+{
+    free(arm->trans_data);
+    arm->trans_data = NULL;
+}
+
+static const arm_transport sim_transport = {
+    "sim", sim_open, sim_transfer, sim_set_speed, sim_close
+};
+
+/***************************************************************************************/
+/* unix socket */
+
+static int remote_open(arm_handle* arm, const char* path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    arm->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (arm->fd < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(arm->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(arm->fd);
+        arm->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int remote_write(int fd, void* data, int len)
+{
+    int n;
+    for (; len > 0; len -= n, data = (uint8_t*) data + n) {
+        n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+    }
+    return 0;
+}
+
+static int remote_transfer(arm_handle* arm, struct spi_ioc_transfer* tr, int count)
+{
+    arm_remote_header hdr;
+    uint16_t frame[2];
+    int i, n, len;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.frames = count;
+    if (remote_write(arm->fd, &hdr, sizeof(hdr)) < 0) return -1;
+    for (i = 0; i < count; i++) {
+        frame[0] = tr[i].len;
+        frame[1] = tr[i].delay_usecs;
+        if (remote_write(arm->fd, frame, sizeof(frame)) < 0) return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (tr[i].len && remote_write(arm->fd, (void*) (unsigned long) tr[i].tx_buf, tr[i].len) < 0)
+            return -1;
+    }
+    for (i = 0; i < count; i++) {
+        uint8_t* rx = (uint8_t*) (unsigned long) tr[i].rx_buf;
+        for (len = tr[i].len; len > 0; len -= n, rx += n) {
+            n = recv(arm->fd, rx, len, 0);
+            if (n <= 0) return -1;
+        }
+    }
+    return count;
+}
+
+static int remote_set_speed(arm_handle* arm, uint32_t speed)
+{
+    arm_remote_header hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.speed = speed;
+    return remote_write(arm->fd, &hdr, sizeof(hdr));
+}
+
+static const arm_transport remote_transport = {
+    "unix", remote_open, remote_transfer, remote_set_speed, spidev_close
+};
+
+/***************************************************************************************/
+/* trace capture */
+
+const char* arm_trace_file = NULL;
+
+typedef struct {
+    const arm_transport* inner;
+    void* inner_data;
+    FILE* f;
+    struct timespec start;
+} arm_capture;
+
+static uint32_t capture_usec(arm_capture* cap, struct timespec* ts)
+{
+    return (ts->tv_sec - cap->start.tv_sec) * 1000000 + (ts->tv_nsec - cap->start.tv_nsec) / 1000;
+}
+
+static void capture_data(FILE* f, struct spi_ioc_transfer* tr, int count, int rx)
+{
+    static const uint8_t zeros[SNIPLEN2 + CRC_SIZE + 40];
+    int i;
+    for (i = 0; i < count; i++) {
+        unsigned long buf = rx ? tr[i].rx_buf : tr[i].tx_buf;
+        if (tr[i].len == 0) continue;
+        if (buf && (tr[i].len <= sizeof(zeros)))
+            fwrite((void*) buf, 1, tr[i].len, f);
+        else
+            fwrite(zeros, 1, (tr[i].len <= sizeof(zeros)) ? tr[i].len : sizeof(zeros), f);
+    }
+}
+
+static int capture_transfer(arm_handle* arm, struct spi_ioc_transfer* tr, int count)
+{
+    arm_capture* cap = arm->trans_data;
+    arm_trace_record rec;
+    struct timespec t1, t2;
+    uint16_t frame[2];
+    int i, ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    arm->trans_data = cap->inner_data;
+    ret = cap->inner->transfer(arm, tr, count);
+    cap->inner_data = arm->trans_data;
+    arm->trans_data = cap;
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    rec.type = ARM_TRACE_XFER;
+    rec.frames = count;
+    rec.result = ret;
+    rec.usec = capture_usec(cap, &t1);
+    rec.value = capture_usec(cap, &t2) - rec.usec;
+    fwrite(&rec, sizeof(rec), 1, cap->f);
+    for (i = 0; i < count; i++) {
+        frame[0] = tr[i].len;
+        frame[1] = tr[i].delay_usecs;
+        fwrite(frame, sizeof(frame), 1, cap->f);
+    }
+    capture_data(cap->f, tr, count, 0);
+    capture_data(cap->f, tr, count, 1);
+    return ret;
+}
+
+static int capture_set_speed(arm_handle* arm, uint32_t speed)
+{
+    arm_capture* cap = arm->trans_data;
+    arm_trace_record rec;
+    struct timespec ts;
+    int ret;
+
+    arm->trans_data = cap->inner_data;
+    ret = cap->inner->set_speed(arm, speed);
+    cap->inner_data = arm->trans_data;
+    arm->trans_data = cap;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    memset(&rec, 0, sizeof(rec));
+    rec.type = ARM_TRACE_SPEED;
+    rec.result = ret;
+    rec.usec = capture_usec(cap, &ts);
+    rec.value = speed;
+    fwrite(&rec, sizeof(rec), 1, cap->f);
+    return ret;
+}
+
+static void capture_close(arm_handle* arm)
+{
+    arm_capture* cap = arm->trans_data;
+
+    arm->trans_data = cap->inner_data;
+    cap->inner->close(arm);
+    fclose(cap->f);
+    free(cap);
+}
+
+static const arm_transport capture_transport = {
+    "capture", NULL, capture_transfer, capture_set_speed, capture_close
+};
+
+/* Wrap opened transport by capture */
+static int capture_start(arm_handle* arm, const char* path)
+{
+    arm_trace_header hdr;
+    arm_capture* cap = calloc(1, sizeof(arm_capture));
+    if (cap == NULL) return -1;
+
+    cap->f = fopen(path, "wb");
+    if (cap->f == NULL) {
+        free(cap);
+        return -1;
+    }
+    hdr.magic = ARM_TRACE_MAGIC;
+    hdr.version = ARM_TRACE_VERSION;
+    hdr.board = arm->index;
+    fwrite(&hdr, sizeof(hdr), 1, cap->f);
+    clock_gettime(CLOCK_MONOTONIC, &cap->start);
+    cap->inner = arm->trans;
+    cap->inner_data = arm->trans_data;
+    arm->trans = &capture_transport;
+    arm->trans_data = cap;
+    return 0;
+}
+
+/***************************************************************************************/
+/* trace replay */
+
+typedef struct {
+    uint8_t* data;
+    uint32_t size;
+    uint32_t pos;
+    uint32_t mismatches;               // transfers differing from trace
+} arm_replay;
+
+static int replay_open(arm_handle* arm, const char* path)
+{
+    arm_trace_header* hdr;
+    arm_replay* rp;
+    FILE* f;
+    long size;
+
+    f = fopen(path, "rb");
+    if (f == NULL) return -1;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    rp = calloc(1, sizeof(arm_replay));
+    if ((rp == NULL) || (size < (long) sizeof(arm_trace_header)) ||
+        ((rp->data = malloc(size)) == NULL) || (fread(rp->data, 1, size, f) != (size_t) size)) {
+        if (rp) free(rp->data);
+        free(rp);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    hdr = (arm_trace_header*) rp->data;
+    if ((hdr->magic != ARM_TRACE_MAGIC) || (hdr->version != ARM_TRACE_VERSION)) {
+        free(rp->data);
+        free(rp);
+        return -1;
+    }
+    rp->size = size;
+    rp->pos = sizeof(arm_trace_header);
+    arm->trans_data = rp;
+    arm->fd = -1;
+    return 0;
+}
+
+/* Length of frames, tx and rx data behind record */
+static uint32_t replay_payload(arm_trace_record* rec, uint32_t* datalen)
+{
+    uint16_t* frame = (uint16_t*) (rec + 1);
+    uint32_t len = 0;
+    int i;
+
+    for (i = 0; i < rec->frames; i++) len += frame[2 * i];
+    *datalen = len;
+    return rec->frames * 2 * sizeof(uint16_t) + 2 * len;
+}
+
+/* Next transfer record, speed records are skipped */
+static arm_trace_record* replay_next(arm_replay* rp)
+{
+    uint32_t datalen;
+
+    while (rp->pos + sizeof(arm_trace_record) <= rp->size) {
+        arm_trace_record* rec = (arm_trace_record*) (rp->data + rp->pos);
+        if (rp->pos + sizeof(arm_trace_record) + rec->frames * 2 * sizeof(uint16_t) > rp->size) break;
+        uint32_t next = rp->pos + sizeof(arm_trace_record) + 
+                        ((rec->type == ARM_TRACE_XFER) ? replay_payload(rec, &datalen) : 0);
+        if (next > rp->size) break;
+        rp->pos = next;
+        if (rec->type == ARM_TRACE_XFER) return rec;
+    }
+    return NULL;
+}
+
+static int replay_transfer(arm_handle* arm, struct spi_ioc_transfer* tr, int count)
+{
+    arm_replay* rp = arm->trans_data;
+    arm_trace_record* rec = replay_next(rp);
+    uint16_t* frame;
+    uint8_t* data;
+    uint32_t datalen;
+    int i;
+
+    if (rec == NULL) return -1;                // end of trace
+    frame = (uint16_t*) (rec + 1);
+    if (rec->frames != count) {
+        rp->mismatches++;
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        if (frame[2 * i] != tr[i].len) {
+            rp->mismatches++;
+            return -1;
+        }
+    }
+    replay_payload(rec, &datalen);
+    // request must be the same as captured. Second phase of reads carries
+    // stale buffer content (and crc of it), only data of writes is compared
+    data = (uint8_t*) (frame + 2 * count) + tr[0].len;
+    arm_comm_header* hdr = (arm_comm_header*) (unsigned long) tr[1].tx_buf;
+    if (memcmp(hdr, data, SIZEOF_HEADER)) {
+        rp->mismatches++;
+    } else if ((count > 2) && ((hdr->op == ARM_OP_WRITE_REG) || (hdr->op == ARM_OP_WRITE_BITS) ||
+                               (hdr->op == ARM_OP_WRITE_STR))) {
+        uint32_t len2 = hdr->len ? hdr->len : 256;
+        if (memcmp((void*) (unsigned long) tr[2].tx_buf, data + tr[1].len, len2))
+            rp->mismatches++;
+    }
+    data = (uint8_t*) (frame + 2 * count) + datalen;
+    for (i = 0; i < count; i++) {
+        if (tr[i].len && tr[i].rx_buf) memcpy((void*) (unsigned long) tr[i].rx_buf, data, tr[i].len);
+        data += tr[i].len;
+    }
+    return rec->result;
+}
+
+static void replay_close(arm_handle* arm)
+{
+    arm_replay* rp = arm->trans_data;
+    free(rp->data);
+    free(rp);
+    arm->trans_data = NULL;
+}
+
+static const arm_transport replay_transport = {
+    "replay", replay_open, replay_transfer, sim_set_speed, replay_close
+};
+
+/* Request of the next transfer in trace, for tools driving upper layers.
+   Returns count of frames, 0 at end of trace */
+int arm_replay_peek(arm_handle* arm, arm_trace_record** rec, uint8_t** tx)
+{
+    arm_replay* rp = arm->trans_data;
+    uint32_t pos;
+
+    if (arm->trans != &replay_transport) return 0;
+    pos = rp->pos;
+    *rec = replay_next(rp);
+    rp->pos = pos;
+    if (*rec == NULL) return 0;
+    *tx = (uint8_t*) (*rec + 1) + (*rec)->frames * 2 * sizeof(uint16_t);
+    return (*rec)->frames;
+}
+
+void arm_replay_skip(arm_handle* arm)
+{
+    if (arm->trans != &replay_transport) return;
+    replay_next((arm_replay*) arm->trans_data);
+}
+
+void arm_replay_rewind(arm_handle* arm)
+{
+    if (arm->trans != &replay_transport) return;
+    ((arm_replay*) arm->trans_data)->pos = sizeof(arm_trace_header);
+}
+
+uint32_t arm_replay_mismatches(arm_handle* arm)
+{
+    if (arm->trans != &replay_transport) return 0;
+    return ((arm_replay*) arm->trans_data)->mismatches;
+}
+
+/***************************************************************************************/
+
+int arm_transport_open(arm_handle* arm, const char* device)
+{
+    const arm_transport* trans = &spidev_transport;
+    const char* path = device;
+
+    if (strncmp(device, "spidev:", 7) == 0) {
+        path = device + 7;
+    } else if (strncmp(device, "sim", 3) == 0) {
+        trans = &sim_transport;
+        path = (device[3] == ':') ? device + 4 : device + 3;
+    } else if (strncmp(device, "unix:", 5) == 0) {
+        trans = &remote_transport;
+        path = device + 5;
+    } else if (strncmp(device, "replay:", 7) == 0) {
+        trans = &replay_transport;
+        path = device + 7;
+    }
+    arm->trans_data = NULL;
+    if (trans->open(arm, path) < 0) return -1;
+    arm->trans = trans;
+
+    if ((arm_trace_file != NULL) && (trans != &replay_transport)) {
+        char name[256];
+        snprintf(name, sizeof(name), "%s.%d", arm_trace_file, arm->index);
+        if (capture_start(arm, name) < 0) perror("Cannot open trace file");
+    }
+    return 0;
+}
+
+void arm_transport_close(arm_handle* arm)
+{
+    if (arm->trans != NULL) arm->trans->close(arm);
+}
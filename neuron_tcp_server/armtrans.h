@@ -0,0 +1,81 @@
+/*
+ * Transports carrying SPI frames of UniPi Neuron family controllers
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+#ifndef __armtrans_h
+#define __armtrans_h
+
+#include <stdint.h>
+#include "armspi.h"
+
+/* Transport is selected by device uri given to arm_init:
+ *   /dev/spidevX.Y or spidev:/dev/spidevX.Y  - real board
+ *   sim[:hw_version]                         - in-process board simulator
+ *   unix:/path/to/socket                     - frames forwarded to local socket
+ *   replay:/path/to/trace                    - replies taken from captured trace
+ *
+ * If arm_trace_file is set, frames of every board are captured to
+ * <arm_trace_file>.<board index>.
+ *
+ * Frames are passed as spi_ioc_transfer array as for SPI_IOC_MESSAGE;
+ * tr[0] is the pause after NSS, tr[1] the header phase, the rest is
+ * the second phase split into chunks.
+ */
+struct _arm_transport {
+    const char* name;
+    int (*open)(arm_handle* arm, const char* path);
+    int (*transfer)(arm_handle* arm, struct spi_ioc_transfer* tr, int count);  // <1 on error
+    int (*set_speed)(arm_handle* arm, uint32_t speed);
+    void (*close)(arm_handle* arm);
+};
+
+/* Message on unix socket: header, then frames[] of {uint16 len, uint16 delay},
+   then tx data of all frames. Reply is rx data of all frames.
+   Header with frames==0 only sets speed and has no reply. */
+typedef struct {
+    uint16_t frames;
+    uint16_t reserved;
+    uint32_t speed;
+} __attribute__((packed)) arm_remote_header;
+
+/* Trace file: "NTRC" magic, version, then records. Record is followed by
+   frames[] of {uint16 len, uint16 delay}, tx data of all frames and
+   rx data of all frames (transfers only) */
+#define ARM_TRACE_MAGIC    0x4352544e      // "NTRC"
+#define ARM_TRACE_VERSION  1
+#define ARM_TRACE_XFER     1
+#define ARM_TRACE_SPEED    2
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t board;
+} __attribute__((packed)) arm_trace_header;
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  frames;
+    int16_t  result;                   // return value of transfer
+    uint32_t usec;                     // since start of capture
+    uint32_t value;                    // duration of transfer [us] or spi speed
+} __attribute__((packed)) arm_trace_record;
+
+extern const char* arm_trace_file;
+
+#define ARMSIM_REGS      2048
+#define ARMSIM_UART_BUF  1024
+
+int arm_transport_open(arm_handle* arm, const char* device);
+void arm_transport_close(arm_handle* arm);
+int arm_replay_peek(arm_handle* arm, arm_trace_record** rec, uint8_t** tx);
+void arm_replay_skip(arm_handle* arm);
+void arm_replay_rewind(arm_handle* arm);
+uint32_t arm_replay_mismatches(arm_handle* arm);
+
+#endif
@@ -37,6 +37,10 @@ int do_prog   = 0;
 int do_resetrw= 0;
 int do_calibrate= 0;
 int do_final= 0;
+int TIMEOUT = 0;            // chunk response timeout [ms], 0 = derived from baud
+int RETRIES = 3;            // attempts per chunk
+
+#define CHUNK_MARGIN 50     // board and pty bridge turnaround [ms]
 
 
 int load_fw(char *path, uint8_t* prog_data, const size_t len)
@@ -56,27 +60,61 @@ int load_fw(char *path, uint8_t* prog_data, const size_t len)
 }
 
 
+/* Set libmodbus response timeout given in milliseconds */
+void set_timeout(modbus_t *ctx, int ms)
+{
+    modbus_set_response_timeout(ctx, ms / 1000, (ms % 1000) * 1000);
+}
+
+/* Time to transfer one data chunk request and its reply over the line plus
+ * turnaround margin. Response timeout counts from the moment the request is
+ * queued in the tty, so the request itself must be included */
+int chunk_timeout(int baud)
+{
+    int chars = (7 + 2*REG_SIZE + 2) + 8;           // write_registers request + reply
+    return (chars * 11 * 1000) / baud + CHUNK_MARGIN;
+}
+
+/* Upload one page into the page buffer of Neuron. Every chunk is retried
+ * separately, so a lost frame costs one short timeout instead of the whole page */
+int send_page(modbus_t *ctx, int page, uint16_t* pd)
+{
+    int chunk, tries;
+
+            set_timeout(ctx, TIMEOUT);
+            if (modbus_write_register(ctx, 0x7705, page) != 1) {   // set page address in Neuron
+                if (verbose) fprintf(stderr, "Setting page failed: %s\n", modbus_strerror(errno));
+                return -1;
+            }
+            for (chunk=0; chunk < 8; chunk++) {
+                for (tries=RETRIES; tries > 0; tries--) {
+                    if (modbus_write_registers(ctx, 0x7700+chunk, REG_SIZE, pd) == REG_SIZE) // send chunk of data (64*2 B)
+                        break;
+                    if (verbose) fprintf(stderr, "Sending chunk %d failed: %s\n", chunk, modbus_strerror(errno));
+                    modbus_flush(ctx);
+                }
+                if (tries == 0) return -1;
+                pd += REG_SIZE;
+            }
+            return 0;
+}
+
 int verify(modbus_t *ctx, uint8_t* prog_data, uint8_t* rw_data, int last_prog_page, int last_page)
 {
     uint16_t* pd;
-    int ret, chunk, page;
-    uint16_t val, reg;
+    int page;
+    uint16_t val;
 
-            modbus_set_response_timeout(ctx, 2, 999999);
             pd = (uint16_t*) prog_data;
             for (page=0; page < last_page; page++) {
                 printf("Verifying page %.2d ...", page);
                 fflush(stdout);
-                if (modbus_write_register(ctx, 0x7705, page) != 1) {   // set page address in Neuron
+                if (send_page(ctx, page, pd) != 0) {
                     fprintf(stderr, "Verifying failed: %s\n", modbus_strerror(errno));
                     break;
                 }
-                for (chunk=0; chunk < 8; chunk++) {
-                    if (modbus_write_registers(ctx, 0x7700+chunk, REG_SIZE, pd) != REG_SIZE) {; // send chunk of data
-                        fprintf(stderr, "Sending data failed: %s\n", modbus_strerror(errno));
-                    }
-                    pd += REG_SIZE;
-                }
+                pd += 8 * REG_SIZE;
+                modbus_set_response_timeout(ctx, 2, 999999);
                 if (modbus_read_registers(ctx, 0x7707, 1, &val) == 1) {
                     if (val == 0x100) {
                         printf(" OK\n");
@@ -97,9 +135,8 @@ int verify(modbus_t *ctx, uint8_t* prog_data, uint8_t* rw_data, int last_prog_pa
 int flashit(modbus_t *ctx, uint8_t* prog_data, uint8_t* rw_data, int last_prog_page, int last_page)
 {
     uint16_t* pd;
-    int ret, chunk, page;
+    int page;
             // Programming
-            modbus_set_response_timeout(ctx, 1, 0);
             page = 0;
             int errors = 0;
             while (page < last_page) {
@@ -110,12 +147,8 @@ int flashit(modbus_t *ctx, uint8_t* prog_data, uint8_t* rw_data, int last_prog_p
                 } else {
                     pd = (uint16_t*) (rw_data + ((page-RW_START_PAGE)*PAGE_SIZE));
                 }
-                if (modbus_write_register(ctx, 0x7705, page) == 1) {   // set page address in Neuron
-                    for (chunk=0; chunk < 8; chunk++) {
-                        if (modbus_write_registers(ctx, 0x7700+chunk, REG_SIZE, pd) == -1) // send chunk of data (64*2 B)
-                            errors++;
-                        pd += REG_SIZE;
-                    }
+                if (send_page(ctx, page, pd) == 0) {
+                    modbus_set_response_timeout(ctx, 1, 0);
                     if (modbus_write_register(ctx, 0x7707, 1) == 1) {  // write page to flash
                         printf(" OK.\n");
                         page++;
@@ -128,6 +161,7 @@ int flashit(modbus_t *ctx, uint8_t* prog_data, uint8_t* rw_data, int last_prog_p
                         fprintf(stderr, "Flashing page failed: %s\n", modbus_strerror(errno));
                     }
                 } else {
+                    // incomplete page is never written to flash
                     errors++;
                     printf(" Trying again.\n");
                 }
@@ -148,18 +182,22 @@ static struct option long_options[] = {
   {"baud",  required_argument,  0, 'b'},
   {"unit",    required_argument,0, 'u'},
   {"dir", required_argument,    0, 'd'},
+  {"timeout", required_argument,0, 't'},
+  {"retries", required_argument,0, 'r'},
   {0, 0, 0, 0}
 };
 
 void print_usage(char *argv0)
 {
     printf("\nUtility for Programming Neuron via ModBus RTU\n");
-    printf("%s [-vVPRC] -p <port> [-u <mb address>] [-b <baudrate>] [-d <firmware dir>] [-F <upper board id>]\n", argv0);
+    printf("%s [-vVPRC] -p <port> [-u <mb address>] [-b <baudrate>] [-d <firmware dir>] [-F <upper board id>] [-t <ms>] [-r <n>]\n", argv0);
     printf("\n");
     printf("--port <port>\t\t /dev/extcomm/1/0 or COM3\n");
     printf("--unit <mb address>\t default 15\n");
     printf("--baud <baudrate>\t default 19200\n");
     printf("--dir <firmware dir>\t default /opt/fw\n");
+    printf("--timeout <ms>\t\t chunk response timeout, default derived from baudrate\n");
+    printf("--retries <n>\t\t attempts per chunk, default 3\n");
     printf("--verbose\t show more messages\n");
     printf("--verify\t compare flash with file\n");
     printf("--programm\t write firmware to flash\n");
@@ -184,7 +222,7 @@ int main(int argc, char **argv)
     char *endptr;
     while (1) {
        int option_index = 0;
-       c = getopt_long(argc, argv, "vVPRCp:b:u:d:F:", long_options, &option_index);
+       c = getopt_long(argc, argv, "vVPRCp:b:u:d:F:t:r:", long_options, &option_index);
        if (c == -1) {
            if (optind < argc)  {
                printf ("non-option ARGV-element: %s\n", argv[optind]);
@@ -238,6 +276,20 @@ int main(int argc, char **argv)
        case 'd':
            firmwaredir = strdup(optarg);
            break;
+       case 't':
+           TIMEOUT = atoi(optarg);
+           if (TIMEOUT<=0) {
+               printf("Timeout must be non-zero integer (given %s)\n", optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'r':
+           RETRIES = atoi(optarg);
+           if (RETRIES<=0) {
+               printf("Retries must be non-zero integer (given %s)\n", optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
 
        default:
            print_usage(argv[0]);
@@ -260,6 +312,8 @@ int main(int argc, char **argv)
     }
     if ( verbose > 1) modbus_set_debug(ctx,verbose-1);
     modbus_set_slave(ctx, DEVICE_ID);
+    if (TIMEOUT == 0) TIMEOUT = chunk_timeout(BAUD);
+    if (verbose) printf("Chunk timeout: %dms\n", TIMEOUT);
 
     if (modbus_connect(ctx) == -1) {
         fprintf(stderr, "Connection failed: %s\n", modbus_strerror(errno));
@@ -17,6 +17,7 @@
 #include <sys/mman.h>
 
 #include "armspi.h"
+#include "armtrans.h"
 #include "armutil.h"
 
 
@@ -259,7 +260,7 @@ int main(int argc, char **argv)
         printf("Firmware: v%d.%d\n", SW_MAJOR(bv.sw_version), SW_MINOR(bv.sw_version));
     } else {
         fprintf(stderr, "Read version failed\n");
-        close(ctx->fd);
+        arm_transport_close(ctx);
         free(ctx);
         return -1;
     }
@@ -273,7 +274,7 @@ int main(int argc, char **argv)
         } else if (do_final) {
             if (!(bv.hw_version & 0x8)) {
                 fprintf(stderr, "Only calibrating version can be reprogrammed to final\n");
-                close(ctx->fd);
+                arm_transport_close(ctx);
                 free(ctx);
                 return -1;
             }
@@ -281,7 +282,7 @@ int main(int argc, char **argv)
             if (bv.hw_version == 0) {
                 fprintf(stderr, "Incompatible base and upper boards. Use one of:\n");
                 print_upboards(bv.base_hw_version);
-                close(ctx->fd);
+                arm_transport_close(ctx);
                 free(ctx);
                 return -1;
             }
@@ -299,7 +300,7 @@ int main(int argc, char **argv)
                 fprintf(stderr, "Firmware file is empty!\n");
             } 
             free(prog_data);
-            close(ctx->fd);
+            arm_transport_close(ctx);
             free(ctx);
             return -1;
         }
@@ -321,7 +322,7 @@ int main(int argc, char **argv)
         // init FW programmer
         //if (write_bit(ctx, 1006, 1) != 1) {
         //    fprintf(stderr, "Program mode setting failed\n");
-        //    close(ctx->fd);
+        //    arm_transport_close(ctx);
         //    free(ctx);
         //    return -1;
         //}
@@ -337,7 +338,7 @@ int main(int argc, char **argv)
         }
         free(prog_data);
     }
-    close(ctx->fd);
+    arm_transport_close(ctx);
     free(ctx);
     return 0;
 }
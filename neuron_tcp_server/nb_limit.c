@@ -0,0 +1,215 @@
+/*
+ * Rate limits of Modbus clients and spi bus of boards
+ *
+ * Every client address has bucket of requests/sec and of spi bytes/sec,
+ * every board a bucket of spi bytes/sec shared by all clients. Requests
+ * over limit are delayed by scheduler, answered from response cache
+ * or refused with busy exception.
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "nb_limit.h"
+
+uint32_t limit_client_rps = 0;         // 0 = unlimited
+uint32_t limit_client_bps = 0;
+uint32_t limit_board_bps = 0;
+int limit_action = NB_LIMIT_DELAY;
+
+static nb_client clients[NB_MAX_CLIENTS];
+static nb_bucket boards[MAX_ARMS];
+static uint32_t board_limited[MAX_ARMS];
+
+typedef struct {
+    uint64_t key;                      // 0 = free
+    uint64_t updated;                  // [ms] monotonic
+    int rsp_length;
+    uint8_t rsp[MODBUS_TCP_MAX_ADU_LENGTH];
+} nb_cached_rsp;
+
+static nb_cached_rsp rsp_cache[NB_RSP_CACHE];
+
+static uint64_t limit_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* client_rps:client_bps[:board_bps[:delay|cache|busy]], 0 = unlimited */
+int nb_limit_parse(const char* conf)
+{
+    char action[8] = "delay";
+    int n = sscanf(conf, "%u:%u:%u:%7s", &limit_client_rps, &limit_client_bps, &limit_board_bps, action);
+    if (n < 2) return -1;
+    if (strcmp(action, "delay") == 0)      limit_action = NB_LIMIT_DELAY;
+    else if (strcmp(action, "cache") == 0) limit_action = NB_LIMIT_CACHE;
+    else if (strcmp(action, "busy") == 0)  limit_action = NB_LIMIT_BUSY;
+    else return -1;
+    return 0;
+}
+
+static void bucket_init(nb_bucket* b, uint32_t rate, uint64_t now)
+{
+    b->rate = rate;
+    b->level = (int64_t)rate * 1000;
+    b->updated = now;
+}
+
+static void bucket_refill(nb_bucket* b, uint64_t now)
+{
+    if (b->rate == 0) return;
+    b->level += (int64_t)b->rate * (now - b->updated);
+    if (b->level > (int64_t)b->rate * 1000) b->level = (int64_t)b->rate * 1000;
+    b->updated = now;
+}
+
+/* [ms] until level is positive */
+static int bucket_wait(nb_bucket* b)
+{
+    if ((b->rate == 0) || (b->level > 0)) return 0;
+    return -b->level / b->rate + 1;
+}
+
+/* Client entry by address; entries of closed clients are reused
+   when table is full. Returns NULL if there is no free entry (unlimited) */
+nb_client* nb_client_get(uint32_t addr)
+{
+    nb_client* free_entry = NULL;
+    int i;
+    for (i = 0; i < NB_MAX_CLIENTS; i++) {
+        nb_client* client = &clients[i];
+        if ((client->addr == addr) && (client->requests.updated != 0)) {
+            client->refs++;
+            return client;
+        }
+        if ((client->refs == 0) && ((free_entry == NULL) || (client->requests.updated == 0)))
+            free_entry = client;
+    }
+    if (free_entry == NULL) return NULL;
+    memset(free_entry, 0, sizeof(nb_client));
+    free_entry->addr = addr;
+    free_entry->refs = 1;
+    bucket_init(&free_entry->requests, limit_client_rps, limit_now_ms());
+    bucket_init(&free_entry->bytes, limit_client_bps, free_entry->requests.updated);
+    return free_entry;
+}
+
+void nb_client_put(nb_client* client)
+{
+    if (client != NULL) client->refs--;
+}
+
+/* Take tokens for request of cost spi bytes. Limits of client are skipped
+   if client is NULL, board budget if board < 0. Priority request is not held
+   by board budget but uses it up. Returns 0 if request may be served now,
+   else [ms] to wait */
+int nb_limit_take(nb_client* client, int board, int cost, int prio)
+{
+    uint64_t now = limit_now_ms();
+    nb_bucket* bus = NULL;
+    int wait = 0, w;
+
+    if (client != NULL) {
+        bucket_refill(&client->requests, now);
+        bucket_refill(&client->bytes, now);
+        wait = bucket_wait(&client->requests);
+        w = bucket_wait(&client->bytes);
+        if (w > wait) wait = w;
+    }
+    if ((board >= 0) && (board < MAX_ARMS) && (limit_board_bps > 0)) {
+        bus = &boards[board];
+        if (bus->updated == 0) bucket_init(bus, limit_board_bps, now);
+        bucket_refill(bus, now);
+        w = prio ? 0 : bucket_wait(bus);
+        if (w > wait) wait = w;
+    }
+    if (wait > 0) return wait;
+
+    if (client != NULL) {
+        if (client->requests.rate) client->requests.level -= 1000;
+        if (client->bytes.rate) client->bytes.level -= cost * 1000;
+        client->served++;
+    }
+    if (bus != NULL) bus->level -= cost * 1000;
+    return 0;
+}
+
+/* Count request held by limits; called once per request after nb_limit_take failed */
+void nb_limit_count(nb_client* client, int board, int action)
+{
+    if ((client != NULL) && (bucket_wait(&client->requests) || bucket_wait(&client->bytes))) {
+        switch (action) {
+        case NB_LIMIT_DELAY: client->delayed++; break;
+        case NB_LIMIT_CACHE: client->cached++; break;
+        case NB_LIMIT_BUSY:  client->busy++; break;
+        }
+    }
+    if ((board >= 0) && (board < MAX_ARMS) && bucket_wait(&boards[board]))
+        board_limited[board]++;
+}
+
+/* Reads of board units are cached, key is {unit, fc, address, count} */
+uint64_t nb_cache_key(uint8_t* req, int req_length)
+{
+    uint8_t* pdu = req + _MODBUS_TCP_HEADER_LENGTH;
+    if ((req_length < _MODBUS_TCP_HEADER_LENGTH + 5) || (pdu[0] < MODBUS_FC_READ_COILS) ||
+        (pdu[0] > MODBUS_FC_READ_INPUT_REGISTERS) || (req[_MODBUS_TCP_HEADER_LENGTH - 1] > MAX_ARMS))
+        return 0;
+    return ((uint64_t)1 << 48) | ((uint64_t)req[_MODBUS_TCP_HEADER_LENGTH - 1] << 40) |
+           ((uint64_t)pdu[0] << 32) | ((uint32_t)pdu[1] << 24) | (pdu[2] << 16) | (pdu[3] << 8) | pdu[4];
+}
+
+static nb_cached_rsp* cache_slot(uint64_t key)
+{
+    return &rsp_cache[(key ^ (key >> 16) ^ (key >> 40)) % NB_RSP_CACHE];
+}
+
+void nb_cache_store(uint64_t key, uint8_t* rsp, int rsp_length)
+{
+    if ((key == 0) || (rsp[_MODBUS_TCP_HEADER_LENGTH] & 0x80)) return;   // no exceptions
+    nb_cached_rsp* slot = cache_slot(key);
+    slot->key = key;
+    slot->updated = limit_now_ms();
+    slot->rsp_length = rsp_length;
+    memcpy(slot->rsp, rsp, rsp_length);
+}
+
+/* Response of the same read overwrites request, transaction id is kept.
+   Returns length of response or 0 if not in cache */
+int nb_cache_reply(uint64_t key, uint8_t* req)
+{
+    nb_cached_rsp* slot = cache_slot(key);
+    if ((key == 0) || (slot->key != key) || (limit_now_ms() - slot->updated > NB_RSP_CACHE_AGE))
+        return 0;
+    memcpy(req + 2, slot->rsp + 2, slot->rsp_length - 2);
+    return slot->rsp_length;
+}
+
+void nb_limit_print_stats(void)
+{
+    int i;
+    for (i = 0; i < NB_MAX_CLIENTS; i++) {
+        nb_client* client = &clients[i];
+        struct in_addr addr;
+        if (client->requests.updated == 0) continue;
+        addr.s_addr = client->addr;
+        printf("Client %s conns=%d served=%u delayed=%u cached=%u busy=%u\n", inet_ntoa(addr),
+               client->refs, client->served, client->delayed, client->cached, client->busy);
+    }
+    for (i = 0; i < MAX_ARMS; i++) {
+        if (board_limited[i])
+            printf("Board%d bus budget %uB/s held %u requests\n", i, limit_board_bps, board_limited[i]);
+    }
+}
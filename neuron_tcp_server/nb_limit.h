@@ -0,0 +1,64 @@
+/*
+ * Rate limits of Modbus clients and spi bus of boards
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+#ifndef __nb_limit_h
+#define __nb_limit_h
+
+#include <stdint.h>
+#include "nb_modbus.h"
+
+/* Request over limit is */
+#define NB_LIMIT_DELAY     0           // kept in queue until tokens come
+#define NB_LIMIT_CACHE     1           // answered by last response of the same read, else delayed
+#define NB_LIMIT_BUSY      2           // answered by SLAVE_OR_SERVER_BUSY exception
+
+#define NB_MAX_CLIENTS     64          // client addresses with own buckets
+#define NB_RSP_CACHE       64          // responses kept for NB_LIMIT_CACHE
+#define NB_RSP_CACHE_AGE   10000       // [ms] older response is not used
+
+/* Token bucket, rate tokens per second, burst of one second.
+   Request is let through while level is positive, its cost can leave
+   bucket in debt, so requests larger than burst pass too */
+typedef struct {
+    uint32_t rate;                     // 0 = unlimited
+    int64_t level;                     // [tokens/1000]
+    uint64_t updated;                  // [ms] monotonic
+} nb_bucket;
+
+typedef struct {
+    uint32_t addr;                     // ipv4, network order
+    int refs;                          // open connections, 0 = entry can be reused
+    nb_bucket requests;
+    nb_bucket bytes;                   // estimated spi bytes
+    // statistics
+    uint32_t served;
+    uint32_t delayed;
+    uint32_t cached;
+    uint32_t busy;
+} nb_client;
+
+extern uint32_t limit_client_rps;
+extern uint32_t limit_client_bps;
+extern uint32_t limit_board_bps;
+extern int limit_action;
+
+#define nb_limit_enabled() (limit_client_rps || limit_client_bps || limit_board_bps)
+
+int nb_limit_parse(const char* conf);
+nb_client* nb_client_get(uint32_t addr);
+void nb_client_put(nb_client* client);
+int nb_limit_take(nb_client* client, int board, int cost, int prio);
+void nb_limit_count(nb_client* client, int board, int action);
+uint64_t nb_cache_key(uint8_t* req, int req_length);
+void nb_cache_store(uint64_t key, uint8_t* rsp, int rsp_length);
+int nb_cache_reply(uint64_t key, uint8_t* req);
+void nb_limit_print_stats(void);
+
+#endif
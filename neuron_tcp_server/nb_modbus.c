@@ -24,6 +24,7 @@
 #include "nb_modbus.h"
 #include "armspi.h"
 #include "armutil.h"
+#include "armtrans.h"
 
 int verbose = 0;
 int deferred_op = DFR_NONE;
@@ -39,7 +40,7 @@ arm_handle*  deferred_arm;
 #define MAX_MESSAGE_LENGTH 260
 
 
-int nb_modbus_reqlen(uint8_t* data, uint8_t size)
+int nb_modbus_reqlen(uint8_t* data, int size)
 {
     if (size < 6) return 0;
     int len = (data[4] << 8) + data[5] + 6;
@@ -48,6 +49,66 @@ int nb_modbus_reqlen(uint8_t* data, uint8_t size)
 }
 
 
+/* Length of RTU request frame (unit, pdu, crc) in data.
+   Returns 0 if not complete yet, -1 for unknown function or frame
+   longer than rtu adu (it would not fit buffer as tcp frame) */
+int nb_modbus_rtu_reqlen(uint8_t* data, int size)
+{
+    int len;
+    if (size < 2) return 0;
+    switch (data[1]) {
+    case 0x01: case 0x02: case 0x03: case 0x04:
+    case 0x05: case 0x06:
+        len = 8;
+        break;
+    case 0x0F: case 0x10:
+        if (size < 7) return 0;
+        len = 7 + data[6] + 2;
+        break;
+    case 0x16:
+        len = 10;
+        break;
+    case 0x17:
+        if (size < 11) return 0;
+        len = 11 + data[10] + 2;
+        break;
+    case 0x07: case 0x11: case NB_FC_SNAPSHOT:
+        len = 4;
+        break;
+    default:
+        return -1;
+    }
+    if (len > MODBUS_RTU_MAX_ADU_LENGTH) return -1;
+    return (size < len) ? 0 : len;
+}
+
+/* RTU request frame to Modbus/Tcp in place (buffer must have 4 bytes
+   more). Returns length of tcp frame, -1 on bad crc */
+int nb_modbus_rtu_to_tcp(uint8_t* data, int len)
+{
+    uint16_t crc = rtu_crc16(data, len - 2);
+    if ((data[len-2] != (crc >> 8)) || (data[len-1] != (crc & 0xff))) return -1;
+    len -= 2;
+    memmove(data + 6, data, len);
+    data[0] = data[1] = 0;                     // transaction id
+    data[2] = data[3] = 0;                     // protocol
+    data[4] = len >> 8;
+    data[5] = len & 0xff;
+    return len + 6;
+}
+
+/* Modbus/Tcp response to RTU frame in place. Returns its length */
+int nb_modbus_tcp_to_rtu(uint8_t* data, int len)
+{
+    len -= 6;
+    memmove(data, data + 6, len);
+    uint16_t crc = rtu_crc16(data, len);
+    data[len++] = crc >> 8;
+    data[len++] = crc & 0xff;
+    return len;
+}
+
+
 /* Build the exception response */
 static int nb_response_exception(modbus_t *ctx, int exception_code, uint8_t *rsp,
                               const char* template, ...)
@@ -79,229 +140,464 @@ static int nb_response_exception(modbus_t *ctx, int exception_code, uint8_t *rsp
 }
 
 
-/* Send a response to the received request.
-   Analyses the request and constructs a response.
+/* Unit 0 addresses all boards, 100 registers per board in each block
+   (0-999, 1000-1999, 2000-2999). Board and address are looked up in
+   table filled once at start, request path does no division */
+#define UNIT0_SPACE 3000
 
-   If an error occurs, this function construct the response
-   accordingly.
-*/
-int nb_modbus_reply(nb_modbus_t *nb_ctx, uint8_t *req, int req_length) //, arm_handle* arm)
+static struct {
+    uint8_t slave;
+    uint16_t address;
+} unit0_table[UNIT0_SPACE];
+
+static void unit0_init(void)
+{
+    int a;
+    for (a = 0; a < UNIT0_SPACE; a++) {
+        unit0_table[a].slave = (a % 1000) / 100 + 1;
+        unit0_table[a].address = (a / 1000) * 1000 + a % 100;
+    }
+}
+
+/* Returns board (slave) and adjusts address */
+static int unit0_map(uint16_t* address)
 {
-    int offset;
     int slave;
-    int function;
-    uint16_t address;
-    uint8_t* rsp = req;
-    arm_handle* arm;
-    int rsp_length = 0;
+    if (*address >= UNIT0_SPACE) return 1;
+    slave = unit0_table[*address].slave;
+    *address = unit0_table[*address].address;
+    return slave;
+}
 
-    if (nb_ctx == NULL) {
-        errno = EINVAL;
-        return -1;
+
+/* Ranges of snapshot: r<addr>:<count> registers, b<addr>:<count> bits */
+int nb_modbus_snapshot(nb_modbus_t *nb_ctx, const char* conf)
+{
+    const char* p = conf;
+    int size = 0;
+
+    nb_ctx->snap_count = 0;
+    while (p && *p) {
+        nb_snap_range* range = &nb_ctx->snap[nb_ctx->snap_count];
+        unsigned int addr, count;
+        if (nb_ctx->snap_count >= NB_SNAP_RANGES) return -1;
+        if ((*p != 'r') && (*p != 'b')) return -1;
+        if (sscanf(p + 1, "%u:%u", &addr, &count) != 2) return -1;
+        if ((count == 0) || (addr > 0xffff)) return -1;
+        range->bits = (*p == 'b');
+        range->addr = addr;
+        range->count = count;
+        if (range->bits) {
+            if (count > 255 * 8) return -1;
+            size += (count + 7) / 8;
+        } else {
+            if (count > MODBUS_MAX_READ_REGISTERS) return -1;
+            size += count * 2;
+        }
+        nb_ctx->snap_count++;
+        p = strchr(p, ',');
+        if (p) p++;
     }
+    if (size + 2 > MODBUS_MAX_PDU_LENGTH - 2) return -1;
+    nb_ctx->snap_size = size;
+    return 0;
+}
 
-    //offset = nb_ctx->ctx->backend->header_length;
-    offset = _MODBUS_TCP_HEADER_LENGTH;
-    slave = req[offset - 1];
-    function = req[offset];
-    address = (req[offset + 1] << 8) + req[offset + 2];
-    rsp_length = _MODBUS_TCP_PRESET_RSP_LENGTH;
-    if (slave == 0) {
-        if (address < 1000) {
-            slave = address / 100 + 1;
-            address = address % 100;
-        } else if (address < 2000) {
-            slave = (address-1000) / 100 + 1;
-            address = (address-1000) % 100 + 1000;
-        } else if (address < 3000) {
-            slave = (address-2000) / 100 + 1;
-            address = (address-2000) % 100 + 2000;
+/* Data of all ranges of one board appended to rsp. Returns 0 or exception code */
+static int snapshot_board(nb_modbus_t *nb_ctx, arm_handle* arm, uint8_t* rsp)
+{
+    uint8_t bits[(MODBUS_MAX_READ_BITS + 15) / 8];
+    uint16_t di;
+    int i, n;
+
+    for (i = 0; i < nb_ctx->snap_count; i++) {
+        nb_snap_range* range = &nb_ctx->snap[i];
+        if (range->bits) {
+            int len = (range->count + 7) / 8;
+            if ((range->addr + range->count <= 16) && arm_cached_di(arm, &di)) {
+                di >>= range->addr;
+                if (range->count < 16) di &= (1 << range->count) - 1;
+                rsp[0] = di & 0xff;
+                if (len > 1) rsp[1] = di >> 8;
+                n = range->count;
+            } else {
+                n = read_bits(arm, range->addr, range->count, bits);
+                memcpy(rsp, bits, len);
+            }
+            if (n < range->count) return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+            rsp += len;
         } else {
-            slave = 1;
+            if ((range->addr == ARM_DI_REG) && (range->count == 1) && arm_cached_di(arm, &di)) {
+                rsp[0] = di >> 8;
+                rsp[1] = di & 0xff;
+                n = 1;
+            } else {
+                n = read_regs_be(arm, range->addr, range->count, rsp);
+            }
+            if (n != range->count) return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+            rsp += range->count * 2;
         }
     }
-    if (slave <= MAX_ARMS) {
-        arm = nb_ctx->arm[slave-1];
-    } else {
-        arm = NULL;
+    return 0;
+}
+
+static int nb_snapshot_reply(nb_modbus_t *nb_ctx, uint8_t *rsp, int slave)
+{
+    int rsp_length = _MODBUS_TCP_PRESET_RSP_LENGTH;
+    int ai, boards = 0;
+
+    for (ai = 0; ai < MAX_ARMS; ai++) {
+        if ((nb_ctx->arm[ai] != NULL) && ((slave == 0) || (slave == ai + 1))) boards++;
     }
-    if (arm == NULL) {
+    if (boards == 0) {
         return nb_response_exception(
             nb_ctx->ctx, MODBUS_EXCEPTION_GATEWAY_TARGET, rsp,
                     "Illegal slave address 0x%0X\n", slave);
     }
+    if ((nb_ctx->snap_count == 0) || (boards * (nb_ctx->snap_size + 2) + 2 > MODBUS_MAX_PDU_LENGTH)) {
+        return nb_response_exception(
+            nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp,
+                    "Snapshot is not configured or too long\n");
+    }
+    rsp_length++;                              // byte count
+    for (ai = 0; ai < MAX_ARMS; ai++) {
+        arm_handle* arm = nb_ctx->arm[ai];
+        if ((arm == NULL) || ((slave != 0) && (slave != ai + 1))) continue;
+        rsp[rsp_length] = ai + 1;
+        rsp[rsp_length+1] = snapshot_board(nb_ctx, arm, rsp + rsp_length + 2);
+        if (rsp[rsp_length+1]) memset(rsp + rsp_length + 2, 0, nb_ctx->snap_size);
+        rsp_length += nb_ctx->snap_size + 2;
+    }
+    rsp[_MODBUS_TCP_PRESET_RSP_LENGTH] = rsp_length - _MODBUS_TCP_PRESET_RSP_LENGTH - 1;
 
-    switch (function) {
-    case MODBUS_FC_READ_COILS:
-    case MODBUS_FC_READ_DISCRETE_INPUTS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        if (nb < 1 || MODBUS_MAX_READ_BITS < nb) {
-            rsp_length = nb_response_exception(
-                nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp,
-                "Illegal nb of values %d in read_bits (max %d)\n", nb, MODBUS_MAX_READ_BITS);
-        } else {
-            rsp[rsp_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
-            int n = read_bits(arm, address, nb, rsp+rsp_length); 
-            if (n >= nb) {
-                rsp_length += (nb / 8) + ((nb % 8) ? 1 : 0);
-            } else {
-                rsp_length = nb_response_exception(
-                    nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp, 
-                    "Illegal data address 0x%0X in read_bits\n", address);
-            }
-        }
-        break;
+    int mbap_length = rsp_length - 6;
+    rsp[4] = mbap_length >> 8;
+    rsp[5] = mbap_length & 0x00FF;
+    return rsp_length;
+}
+
+
+/* Request being served, shared by handlers of function codes */
+typedef struct {
+    nb_modbus_t* nb_ctx;
+    arm_handle* arm;
+    uint8_t* req;                      // response is built in the same buffer
+    int req_length;
+    int slave;
+    uint16_t address;
+    int nb;                            // count field of request
+} nb_request;
+
+#define REQ_PDU(r, i)   ((r)->req[_MODBUS_TCP_HEADER_LENGTH + (i)])
+#define REQ_WORD(r, i)  ((REQ_PDU(r, i) << 8) + REQ_PDU(r, (i) + 1))
+
+/* Handler returns length of response, 0 if response is echo of request
+   header or -exception code */
+typedef int (*nb_handler)(nb_request* r);
+
+typedef struct {
+    nb_handler handler;
+    const char* name;
+    uint8_t flags;
+    uint8_t pdu_len;                   // min length of request pdu
+    uint8_t echo;                      // pdu bytes echoed in response after function
+    uint16_t max_count;                // count field checked for 1..max_count, 0 = no count
+} nb_function;
+
+#define NB_F_ANY_UNIT  0x01            // no board is selected by unit/address
+#define NB_F_WRITE     0x02            // changes outputs, scheduled in priority lane
+
+static int fc_read_bits(nb_request* r)
+{
+    uint8_t* rsp = r->req + _MODBUS_TCP_PRESET_RSP_LENGTH;
+    int len = (r->nb + 7) >> 3;
+    uint16_t di;
+    int n;
+
+    rsp[0] = len;
+    if ((r->address + r->nb <= 16) && arm_cached_di(r->arm, &di)) {
+        /* inputs are refreshed by interrupt */
+        di >>= r->address;
+        if (r->nb < 16) di &= (1 << r->nb) - 1;
+        rsp[1] = di & 0xff;
+        if (r->nb > 8) rsp[2] = di >> 8;
+        n = r->nb;
+    } else {
+        n = read_bits(r->arm, r->address, r->nb, rsp + 1);
     }
+    if (n < r->nb) return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    return _MODBUS_TCP_PRESET_RSP_LENGTH + 1 + len;
+}
+
+static int fc_read_registers(nb_request* r)
+{
+    uint8_t* rsp = r->req + _MODBUS_TCP_PRESET_RSP_LENGTH;
+    uint16_t di;
+    int n;
+
+    rsp[0] = r->nb << 1;
+    if ((r->address == ARM_DI_REG) && (r->nb == 1) && arm_cached_di(r->arm, &di)) {
+        rsp[1] = di >> 8;                      /* inputs are refreshed by interrupt */
+        rsp[2] = di & 0xff;
+        n = 1;
+    } else {
+        n = read_regs_be(r->arm, r->address, r->nb, rsp + 1);
+    }
+    if (n != r->nb) return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    return _MODBUS_TCP_PRESET_RSP_LENGTH + 1 + (r->nb << 1);
+}
+
+static int fc_write_coil(nb_request* r)
+{
+    int data = REQ_WORD(r, 3);
+    int n;
+
+    if ((data != 0xFF00) && (data != 0x0)) 
+        return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    if (r->address == 1004) {                  // exception for firmware
+        deferred_op = DFR_OP_FIRMWARE;
+        deferred_arm = r->arm;
+        n = 1;
+    } else {
+        n = write_bit(r->arm, r->address, data ? 1 : 0);
+    }
+    return (n == 1) ? 0 : -MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE;
+}
+
+static int fc_write_register(nb_request* r)
+{
+    uint16_t data = REQ_WORD(r, 3);
+    return (write_regs(r->arm, r->address, 1, &data) == 1) ? 0 : -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+}
 
+static int fc_write_coils(nb_request* r)
+{
+    if ((REQ_PDU(r, 5) < ((r->nb + 7) >> 3)) || (r->req_length < _MODBUS_TCP_HEADER_LENGTH + 6 + REQ_PDU(r, 5)))
+        return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    int n = write_bits(r->arm, r->address, r->nb, &REQ_PDU(r, 6));
+    return (n == r->nb) ? 0 : -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+}
+
+static int fc_write_registers(nb_request* r)
+{
+    if ((REQ_PDU(r, 5) < (r->nb << 1)) || (r->req_length < _MODBUS_TCP_HEADER_LENGTH + 6 + REQ_PDU(r, 5)))
+        return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    int n = write_regs_be(r->arm, r->address, r->nb, &REQ_PDU(r, 6));
+    return (n == r->nb) ? 0 : -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+}
+
+static int fc_mask_write(nb_request* r)
+{
+    int n = arm_mask_write(r->arm, r->address, REQ_WORD(r, 3), REQ_WORD(r, 5));
+    return (n == 1) ? 0 : -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+}
+
+static int fc_write_and_read(nb_request* r)
+{
+    uint8_t* rsp = r->req + _MODBUS_TCP_PRESET_RSP_LENGTH;
+    uint16_t address_write = REQ_WORD(r, 5);
+    int nb_write = REQ_WORD(r, 7);
+    int n;
+
+    if ((r->req[_MODBUS_TCP_HEADER_LENGTH - 1] == 0) && (unit0_map(&address_write) != r->slave))
+        return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;      // write on other board
+    if (nb_write < 1 || MODBUS_MAX_WR_WRITE_REGISTERS < nb_write ||
+        REQ_PDU(r, 9) != nb_write * 2 || r->req_length < _MODBUS_TCP_HEADER_LENGTH + 10 + nb_write * 2)
+        return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    /* write is done first, then registers are read back
+       into the same buffer (response overwrites the request) */
+    n = write_regs_be(r->arm, address_write, nb_write, &REQ_PDU(r, 10));
+    if (n == nb_write) n = read_regs_be(r->arm, r->address, r->nb, rsp + 1);
+    if (n != r->nb) return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    rsp[0] = r->nb << 1;
+    return _MODBUS_TCP_PRESET_RSP_LENGTH + 1 + (r->nb << 1);
+}
+
+static int fc_report_slave_id(nb_request* r)
+{
+    uint8_t* rsp = r->req + _MODBUS_TCP_PRESET_RSP_LENGTH;
+    /* LMB + length of LIBMODBUS_VERSION_STRING */
+    int str_len = 3 + strlen(LIBMODBUS_VERSION_STRING);
+
+    rsp[0] = str_len + 2;                      // byte count
+    rsp[1] = _REPORT_MB_SLAVE_ID;
+    rsp[2] = 0xFF;                             // run indicator status to ON
+    memcpy(rsp + 3, "SPI" LIBMODBUS_VERSION_STRING, str_len);
+    return _MODBUS_TCP_PRESET_RSP_LENGTH + 3 + str_len;
+}
+
+static int fc_snapshot(nb_request* r)
+{
+    return nb_snapshot_reply(r->nb_ctx, r->req, r->slave);
+}
+
+static const nb_function nb_functions[256] = {
+    [MODBUS_FC_READ_COILS]               = { fc_read_bits, "read_bits", 0, 5, 0, MODBUS_MAX_READ_BITS },
+    [MODBUS_FC_READ_DISCRETE_INPUTS]     = { fc_read_bits, "read_bits", 0, 5, 0, MODBUS_MAX_READ_BITS },
+    [MODBUS_FC_READ_HOLDING_REGISTERS]   = { fc_read_registers, "read_registers", 0, 5, 0, MODBUS_MAX_READ_REGISTERS },
+    [MODBUS_FC_READ_INPUT_REGISTERS]     = { fc_read_registers, "read_registers", 0, 5, 0, MODBUS_MAX_READ_REGISTERS },
+    [MODBUS_FC_WRITE_SINGLE_COIL]        = { fc_write_coil, "write_bit", NB_F_WRITE, 5, 4, 0 },
+    [MODBUS_FC_WRITE_SINGLE_REGISTER]    = { fc_write_register, "write_single_register", NB_F_WRITE, 5, 4, 0 },
+    [MODBUS_FC_WRITE_MULTIPLE_COILS]     = { fc_write_coils, "write_bits", NB_F_WRITE, 6, 4, MODBUS_MAX_WRITE_BITS },
+    [MODBUS_FC_WRITE_MULTIPLE_REGISTERS] = { fc_write_registers, "write_registers", NB_F_WRITE, 6, 4, MODBUS_MAX_WRITE_REGISTERS },
+    [MODBUS_FC_REPORT_SLAVE_ID]          = { fc_report_slave_id, "report_slave_id", 0, 1, 0, 0 },
+    [MODBUS_FC_MASK_WRITE_REGISTER]      = { fc_mask_write, "mask_write_register", NB_F_WRITE, 7, 6, 0 },
+    [MODBUS_FC_WRITE_AND_READ_REGISTERS] = { fc_write_and_read, "write_and_read_registers", NB_F_WRITE, 10, 0, MODBUS_MAX_WR_READ_REGISTERS },
+    [NB_FC_SNAPSHOT]                     = { fc_snapshot, "snapshot", NB_F_ANY_UNIT, 1, 0, 0 },
+};
+
+
+/* Estimated spi bytes moved by request, header phase of every op included.
+   Returns -cost for functions changing outputs */
+int nb_modbus_cost(nb_modbus_t *nb_ctx, uint8_t *req, int req_length)
+{
+    const nb_function* fc = &nb_functions[req[_MODBUS_TCP_HEADER_LENGTH]];
+    int cost = 2 * SNIPLEN1;
+    int nb = 0;
+
+    if (req_length >= _MODBUS_TCP_HEADER_LENGTH + 5)
+        nb = (req[_MODBUS_TCP_HEADER_LENGTH + 3] << 8) + req[_MODBUS_TCP_HEADER_LENGTH + 4];
+    switch (req[_MODBUS_TCP_HEADER_LENGTH]) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        cost += ((nb + 15) >> 4) << 1;
+        break;
     case MODBUS_FC_READ_HOLDING_REGISTERS:
-    case MODBUS_FC_READ_INPUT_REGISTERS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-        if (nb < 1 || MODBUS_MAX_READ_REGISTERS < nb) {
-            rsp_length = nb_response_exception(
-                nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, 
-                "Illegal nb of values %d in read_register (max %d)\n", nb, MODBUS_MAX_READ_REGISTERS);
-        } else {
-            int i;
-            uint8_t c;
-
-            rsp[rsp_length++] = nb << 1;
-            int n = read_regs(arm, address, nb, (uint16_t*) (rsp+rsp_length));
-            if (n == nb) {
-                for (i = address; i < address + nb; i++) {
-                    c = rsp[rsp_length++];
-                    rsp[rsp_length-1] = rsp[rsp_length];
-                    rsp[rsp_length++] = c;
-                }
-            } else {
-                rsp_length = nb_response_exception(
-                    nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp,
-                    "Illegal data address 0x%0X in read_register\n", address);
-            }
-        }
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        cost += nb << 1;
+        break;
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        cost += 2 * SNIPLEN1 + (nb << 1) + req_length - _MODBUS_TCP_HEADER_LENGTH - 10;
+        break;
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        cost += 2 * SNIPLEN1;                  // read and write
+        break;
+    case NB_FC_SNAPSHOT:
+        cost = (nb_ctx->snap_count * 2 * SNIPLEN1 + nb_ctx->snap_size) *
+               ((req[_MODBUS_TCP_HEADER_LENGTH - 1] == 0) ? MAX_ARMS : 1);
         break;
     }
-    case MODBUS_FC_WRITE_SINGLE_COIL: {
-        int data = (req[offset + 3] << 8) + req[offset + 4];
+    if (cost > 0xffff) cost = 0xffff;
+    return (fc->flags & NB_F_WRITE) ? -cost : cost;
+}
 
-        if ((data != 0xFF00) && (data != 0x0)) {
-            rsp_length = nb_response_exception(
-                nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp, FALSE,
-                "Illegal data value 0x%0X in write_bit request at address %0X\n", data, address);
-        } else {
-            int n;
-            if (address == 1004) { // exception for firmware
-                //arm_firmware(arm, nb_ctx->fwdir, data ? 1 : 0);
-                deferred_op = DFR_OP_FIRMWARE;
-                deferred_arm = arm;
-                n = 1;
-            } else
-                n = write_bit(arm, address, data ? 1 : 0);
-            if (n == 1) {
-                rsp_length += 4; // = req_length;
-            } else {
-                rsp_length = nb_response_exception(
-                    nb_ctx->ctx, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE, rsp,
-                    "Illegal data address 0x%0X in write_bit\n", address);
-            }
-        }
-        break;
+
+/* Index of board served by request, -1 for downstream units, boards not present
+   and functions of any unit */
+int nb_modbus_board(nb_modbus_t *nb_ctx, uint8_t *req, int req_length)
+{
+    const nb_function* fc = &nb_functions[req[_MODBUS_TCP_HEADER_LENGTH]];
+    int slave = req[_MODBUS_TCP_HEADER_LENGTH - 1];
+    uint16_t address;
+
+    if ((fc->handler == NULL) || (fc->flags & NB_F_ANY_UNIT) || (slave > MAX_ARMS) ||
+        (req_length < _MODBUS_TCP_HEADER_LENGTH + 3))
+        return -1;
+    if (slave == 0) {
+        address = (req[_MODBUS_TCP_HEADER_LENGTH + 1] << 8) + req[_MODBUS_TCP_HEADER_LENGTH + 2];
+        slave = unit0_map(&address);
     }
-    case MODBUS_FC_WRITE_SINGLE_REGISTER: {
-        uint16_t data = (req[offset + 3] << 8) + req[offset + 4];
+    if ((slave < 1) || (slave > MAX_ARMS) || (nb_ctx->arm[slave - 1] == NULL))
+        return -1;
+    return slave - 1;
+}
 
-        int n = write_regs(arm, address, 1, &data);
-        if (n == 1) {
-            rsp_length += 4; // = req_length;
-        } else {
-            rsp_length = nb_response_exception(
-                    nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp,
-                    "Illegal data address 0x%0X in write_single_register\n", address);
-        }
-        break;
+/* Exception response built in place of request */
+int nb_modbus_exception(nb_modbus_t *nb_ctx, int exception_code, uint8_t *req)
+{
+    return nb_response_exception(nb_ctx->ctx, exception_code, req,
+                                 "Exception %d for function 0x%0X\n", exception_code, req[_MODBUS_TCP_HEADER_LENGTH]);
+}
+
+
+/* Send a response to the received request.
+   Analyses the request and constructs a response.
+
+   If an error occurs, this function construct the response
+   accordingly.
+*/
+int nb_modbus_reply(nb_modbus_t *nb_ctx, uint8_t *req, int req_length) //, arm_handle* arm)
+{
+    const nb_function* fc;
+    nb_request r;
+    int rsp_length;
+
+    if (nb_ctx == NULL) {
+        errno = EINVAL;
+        return -1;
     }
-    case MODBUS_FC_WRITE_MULTIPLE_COILS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-
-        if (nb < 1 || MODBUS_MAX_WRITE_BITS < nb) {
-            rsp_length = nb_response_exception(
-                nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp,
-                "Illegal number of values %d in write_bits (max %d)\n", nb, MODBUS_MAX_WRITE_BITS);
-        } else if (address < 0 ) {
-        } else {
-            /* 6 = byte count */
-            int n = write_bits(arm, address, nb, rsp+rsp_length + 5);
-            if ( n == nb ) {
-                rsp_length += 4;
-            } else {
-                rsp_length = nb_response_exception(
-                    nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp,
-                    "Illegal data address 0x%0X in write_bits\n",  address);
-            }
-        }
+
+    r.nb_ctx = nb_ctx;
+    r.req = req;
+    r.req_length = req_length;
+    r.slave = req[_MODBUS_TCP_HEADER_LENGTH - 1];
+    fc = &nb_functions[req[_MODBUS_TCP_HEADER_LENGTH]];
+    if (fc->handler == NULL) {
+        return nb_response_exception(
+            nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, req, 
+            "Unknown Modbus function code: 0x%0X\n", req[_MODBUS_TCP_HEADER_LENGTH]);
     }
-        break;
-    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
-        int nb = (req[offset + 3] << 8) + req[offset + 4];
-
-        if (nb < 1 || MODBUS_MAX_WRITE_REGISTERS < nb) {
-            rsp_length = nb_response_exception(
-                nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, rsp,
-                "Illegal number of values %d in write_registers (max %d)\n",
-                nb, MODBUS_MAX_WRITE_REGISTERS);
-        } else {
-            int i, j;
-            uint8_t c;   
-            for (i = 0, j = rsp_length+5; i < nb; i++, j += 2) {
-                c = rsp[j];
-                rsp[j] = rsp[j+1];
-                rsp[j+1] = c;
-            }
+    if (req_length < _MODBUS_TCP_HEADER_LENGTH + fc->pdu_len) {
+        return nb_response_exception(
+            nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, req,
+            "Short request in %s\n", fc->name);
+    }
+    if (fc->flags & NB_F_ANY_UNIT) 
+        return fc->handler(&r);
 
-            int n = write_regs(arm, address, nb, (uint16_t*)(rsp + rsp_length + 5));
-            if (n == nb) {
-                rsp_length += 4; // = req_length;
-            } else {
-                rsp_length = nb_response_exception(
-                    nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS, rsp,
-                    "Illegal data address 0x%0X in write_registers\n", address);
-            }
-        }
+    r.address = REQ_WORD(&r, 1);
+    if (r.slave == 0) {
+        r.slave = unit0_map(&r.address);
     }
-        break;
-    case MODBUS_FC_REPORT_SLAVE_ID: {
-        int str_len;
-        int byte_count_pos;
-
-        /* Skip byte count for now */
-        byte_count_pos = rsp_length++;
-        rsp[rsp_length++] = _REPORT_MB_SLAVE_ID;
-        /* Run indicator status to ON */
-        rsp[rsp_length++] = 0xFF;
-        /* LMB + length of LIBMODBUS_VERSION_STRING */
-        str_len = 3 + strlen(LIBMODBUS_VERSION_STRING);
-        memcpy(rsp + rsp_length, "SPI" LIBMODBUS_VERSION_STRING, str_len);
-        rsp_length += str_len;
-        rsp[byte_count_pos] = rsp_length - byte_count_pos - 1;
+    r.arm = (r.slave <= MAX_ARMS) ? nb_ctx->arm[r.slave-1] : NULL;
+    if (r.arm == NULL) {
+        return nb_response_exception(
+            nb_ctx->ctx, MODBUS_EXCEPTION_GATEWAY_TARGET, req,
+                    "Illegal slave address 0x%0X\n", r.slave);
+    }
+    if (fc->max_count) {
+        r.nb = REQ_WORD(&r, 3);
+        if (r.nb < 1 || fc->max_count < r.nb) {
+            return nb_response_exception(
+                nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE, req,
+                "Illegal nb of values %d in %s (max %d)\n", r.nb, fc->name, fc->max_count);
+        }
     }
-        break;
 
-    default:
-        rsp_length = nb_response_exception(
-            nb_ctx->ctx, MODBUS_EXCEPTION_ILLEGAL_FUNCTION, rsp, 
-            "Unknown Modbus function code: 0x%0X\n", function);
-        break;
+    rsp_length = fc->handler(&r);
+    if (rsp_length == 0) {
+        rsp_length = _MODBUS_TCP_PRESET_RSP_LENGTH + fc->echo;   // = req_length
+    } else if (rsp_length < 0) {
+        return nb_response_exception(
+            nb_ctx->ctx, -rsp_length, req,
+            "Exception %d at address 0x%0X in %s\n", -rsp_length, r.address, fc->name);
     }
 
     /* Substract the header length to the message length */
     int mbap_length = rsp_length - 6;
 
-    rsp[4] = mbap_length >> 8;
-    rsp[5] = mbap_length & 0x00FF;
+    req[4] = mbap_length >> 8;
+    req[5] = mbap_length & 0x00FF;
 
     return rsp_length;
 }
 
 
+/* Pass request for downstream rtu slave to gateway.
+   Returns 1 if request was queued; reply comes later by gateway callback */
+int nb_modbus_gateway(nb_modbus_t *nb_ctx, void* owner, uint8_t *req, int req_length)
+{
+    int slave = req[_MODBUS_TCP_HEADER_LENGTH - 1];
+    if ((slave <= MAX_ARMS) || (nb_ctx->gateway[slave] == NULL))
+        return 0;
+    if (rtu_submit(nb_ctx->gateway[slave], owner, req, req_length) < 0)
+        return 0;
+    return 1;
+}
+
+
 nb_modbus_t*  nb_modbus_new_tcp(const char *ip_address, int port)
 {
     modbus_t* ctx = modbus_new_tcp(ip_address, port);
@@ -313,19 +609,32 @@ nb_modbus_t*  nb_modbus_new_tcp(const char *ip_address, int port)
         return NULL;
     }
     nb_ctx->ctx = ctx;
+    unit0_init();
+    return nb_ctx;
 }
 
 
 void nb_modbus_free(nb_modbus_t*  nb_ctx)
 {
     if (nb_ctx != NULL) {
-        int i;
+        int i, j;
         modbus_free(nb_ctx->ctx);
+        for (i=MAX_ARMS+1; i<256; i++) {
+            rtu_channel* channel = nb_ctx->gateway[i];
+            if (channel == NULL) continue;
+            for (j=i; j<256; j++) {                 // channel serves range of units
+                if (nb_ctx->gateway[j] == channel) nb_ctx->gateway[j] = NULL;
+            }
+            rtu_channel_free(channel);
+        }
         for (i=0; i<MAX_ARMS; i++) {
             if (nb_ctx->arm[i] != NULL) {
-                close(nb_ctx->arm[i]->fd);
+                arm_transport_close(nb_ctx->arm[i]);
                 if (nb_ctx->arm[i]->fdint >= 0) 
                     close(nb_ctx->arm[i]->fdint);
+                if (nb_ctx->arm[i]->polltimer >= 0) 
+                    close(nb_ctx->arm[i]->polltimer);
+                arm_free_queues(nb_ctx->arm[i]);
                 free(nb_ctx->arm[i]);
             }
         }
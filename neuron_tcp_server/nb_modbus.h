@@ -15,6 +15,7 @@
 #include <modbus/modbus.h>
 
 #include "armspi.h"
+#include "armrtu.h"
 
 #define MAX_ARMS 3
 // from modbus_private_h
@@ -37,11 +38,28 @@
 #define MODBUS_FC_MASK_WRITE_REGISTER       0x16
 #define MODBUS_FC_WRITE_AND_READ_REGISTERS  0x17
 
+/* Vendor function: packed snapshot of configured ranges of one board
+   (unit 1..3) or of all boards (unit 0). Response is byte count and for
+   each board {index, exception code or 0, data of ranges in order of
+   configuration}; registers are big endian, bits packed as in FC1 */
+#define NB_FC_SNAPSHOT                      0x41
+#define NB_SNAP_RANGES                      16
+
+
+typedef struct {
+    uint8_t bits;                      // coils/inputs, else registers
+    uint16_t addr;
+    uint16_t count;
+} nb_snap_range;
 
 typedef struct {
     modbus_t* ctx;
     arm_handle* arm[MAX_ARMS];
     char * fwdir;
+    rtu_channel* gateway[256];         // downstream rtu line by unit id
+    nb_snap_range snap[NB_SNAP_RANGES];
+    int snap_count;
+    int snap_size;                     // data bytes of one board
 } nb_modbus_t;
 
 #define DFR_NONE 0
@@ -53,8 +71,16 @@ extern int verbose;
 
 nb_modbus_t*  nb_modbus_new_tcp(const char *ip_address, int port);
 void nb_modbus_free(nb_modbus_t*  nb_ctx);
-int nb_modbus_reqlen(uint8_t* data, uint8_t size);
+int nb_modbus_reqlen(uint8_t* data, int size);
+int nb_modbus_rtu_reqlen(uint8_t* data, int size);
+int nb_modbus_rtu_to_tcp(uint8_t* data, int len);
+int nb_modbus_tcp_to_rtu(uint8_t* data, int len);
 int nb_modbus_reply(nb_modbus_t *nb_ctx, uint8_t *req, int req_length); 
+int nb_modbus_cost(nb_modbus_t *nb_ctx, uint8_t *req, int req_length);
+int nb_modbus_board(nb_modbus_t *nb_ctx, uint8_t *req, int req_length);
+int nb_modbus_exception(nb_modbus_t *nb_ctx, int exception_code, uint8_t *req);
+int nb_modbus_snapshot(nb_modbus_t *nb_ctx, const char* conf);
+int nb_modbus_gateway(nb_modbus_t *nb_ctx, void* owner, uint8_t *req, int req_length);
 int add_arm(nb_modbus_t*  nb_ctx, uint8_t index, const char *device, int speed, const char* gpio);
 int arm_firmware(arm_handle* arm, const char* fwdir, int rw);
 #endif
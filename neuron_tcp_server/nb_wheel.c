@@ -0,0 +1,100 @@
+/*
+ * Hashed timer wheel for timeouts of many connections
+ *
+ * Arming and disarming is O(1), every tick walks only one slot.
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "nb_wheel.h"
+
+int nb_wheel_init(nb_wheel* wheel)
+{
+    struct itimerspec its;
+    int i;
+
+    memset(wheel, 0, sizeof(nb_wheel));
+    for (i = 0; i < NB_WHEEL_SLOTS; i++)
+        wheel->slots[i].next = wheel->slots[i].prev = &wheel->slots[i];
+    wheel->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (wheel->timerfd < 0) return -1;
+    its.it_value.tv_sec = its.it_interval.tv_sec = NB_WHEEL_TICK / 1000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = (NB_WHEEL_TICK % 1000) * 1000000;
+    timerfd_settime(wheel->timerfd, 0, &its, NULL);
+    return wheel->timerfd;
+}
+
+/* Arm timer to expire after ms, armed timer is moved */
+void nb_timer_add(nb_wheel* wheel, nb_timer* timer, uint32_t ms)
+{
+    uint32_t ticks = (ms + NB_WHEEL_TICK - 1) / NB_WHEEL_TICK;
+    nb_timer* slot;
+
+    if (ticks == 0) ticks = 1;
+    nb_timer_del(wheel, timer);
+    timer->rounds = (ticks - 1) / NB_WHEEL_SLOTS;
+    slot = &wheel->slots[(wheel->current + ticks) & (NB_WHEEL_SLOTS - 1)];
+    timer->next = slot->next;
+    timer->prev = slot;
+    slot->next->prev = timer;
+    slot->next = timer;
+    wheel->armed++;
+}
+
+void nb_timer_del(nb_wheel* wheel, nb_timer* timer)
+{
+    if (timer->next == NULL) return;
+    timer->next->prev = timer->prev;
+    timer->prev->next = timer->next;
+    timer->next = timer->prev = NULL;
+    wheel->armed--;
+}
+
+/* Timerfd of wheel expired, advance by all ticks passed */
+void nb_wheel_tick(nb_wheel* wheel)
+{
+    uint64_t expirations;
+    if (read(wheel->timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    while (expirations-- > 0) {
+        nb_timer* slot;
+        nb_timer* timer;
+
+        wheel->current = (wheel->current + 1) & (NB_WHEEL_SLOTS - 1);
+        slot = &wheel->slots[wheel->current];
+        /* expired timers are taken out first, callbacks can arm timers again */
+        nb_timer expired = { &expired, &expired, 0, NULL };
+        for (timer = slot->next; timer != slot; ) {
+            nb_timer* next = timer->next;
+            if (timer->rounds > 0) {
+                timer->rounds--;
+            } else {
+                timer->next->prev = timer->prev;
+                timer->prev->next = timer->next;
+                timer->next = expired.next;
+                timer->prev = &expired;
+                expired.next->prev = timer;
+                expired.next = timer;
+            }
+            timer = next;
+        }
+        while (expired.next != &expired) {
+            timer = expired.next;
+            expired.next = timer->next;
+            timer->next->prev = &expired;
+            timer->next = timer->prev = NULL;
+            wheel->armed--;
+            wheel->expired++;
+            timer->expire(timer);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * Hashed timer wheel for timeouts of many connections
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+#ifndef __nb_wheel_h
+#define __nb_wheel_h
+
+#include <stdint.h>
+
+#define NB_WHEEL_SLOTS    256          // power of two
+#define NB_WHEEL_TICK     100          // [ms]
+
+/* Timer is embedded in owner structure. Timer is in slot list of wheel
+   while armed, longer timeouts wait for rounds of the whole wheel */
+typedef struct _nb_timer nb_timer;
+struct _nb_timer {
+    nb_timer* next;                    // NULL = not armed
+    nb_timer* prev;
+    uint32_t rounds;
+    void (*expire)(nb_timer* timer);   // timer is disarmed before call
+};
+
+typedef struct {
+    nb_timer slots[NB_WHEEL_SLOTS];    // list heads
+    uint32_t current;
+    int timerfd;                       // ticks of wheel
+    uint32_t armed;
+    uint32_t expired;
+} nb_wheel;
+
+int nb_wheel_init(nb_wheel* wheel);
+void nb_timer_add(nb_wheel* wheel, nb_timer* timer, uint32_t ms);
+void nb_timer_del(nb_wheel* wheel, nb_timer* timer);
+void nb_wheel_tick(nb_wheel* wheel);
+
+#define nb_timer_armed(t)  ((t)->next != NULL)
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Micro-benchmark of Modbus request parsing and response building
+ *
+ * Requests are passed directly to nb_modbus_reply, board is simulated
+ * in-process (or any other transport given by -s), so the result is
+ * throughput of the modbus layer and armspi without network and bus.
+ *
+ * Copyright (c) 2016  Faster CZ, ondra@faster.cz
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "armspi.h"
+#include "armtrans.h"
+#include "nb_modbus.h"
+
+typedef struct {
+    const char* name;
+    uint8_t unit;
+    uint8_t pdu[32];
+    int pdu_len;
+} bench_request;
+
+static const bench_request requests[] = {
+    { "fc03 1 reg",        1, { 0x03, 0x00, 0x00, 0x00, 0x01 }, 5 },
+    { "fc03 125 regs",     1, { 0x03, 0x00, 0x00, 0x00, 0x7d }, 5 },
+    { "fc03 unit0",        0, { 0x03, 0x03, 0xe8, 0x00, 0x05 }, 5 },
+    { "fc01 16 bits",      1, { 0x01, 0x00, 0x00, 0x00, 0x10 }, 5 },
+    { "fc05 coil",         1, { 0x05, 0x00, 0x10, 0xff, 0x00 }, 5 },
+    { "fc06 reg",          1, { 0x06, 0x00, 0x01, 0x12, 0x34 }, 5 },
+    { "fc16 4 regs",       1, { 0x10, 0x00, 0x01, 0x00, 0x04, 0x08, 1, 2, 3, 4, 5, 6, 7, 8 }, 14 },
+    { "fc23 2w/4r",        1, { 0x17, 0x00, 0x01, 0x00, 0x04, 0x00, 0x01, 0x00, 0x02, 0x04, 1, 2, 3, 4 }, 14 },
+    { "unknown fc",        1, { 0x2b }, 1 },
+};
+
+#define REQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+static int build_req(uint8_t* req, const bench_request* r)
+{
+    memset(req, 0, 4);
+    req[4] = (r->pdu_len + 1) >> 8;
+    req[5] = (r->pdu_len + 1) & 0xff;
+    req[6] = r->unit;
+    memcpy(req + 7, r->pdu, r->pdu_len);
+    return r->pdu_len + 7;
+}
+
+static double elapsed_ns(struct timespec* t1, struct timespec* t2)
+{
+    return (t2->tv_sec - t1->tv_sec) * 1e9 + (t2->tv_nsec - t1->tv_nsec);
+}
+
+static void print_usage(const char *progname)
+{
+    printf("usage: %s [-n iterations] [-s device] [-T tracefile]\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 100000;
+    const char* device = "sim";
+    uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+    struct timespec t1, t2;
+    double total = 0;
+    int c, i, len;
+    size_t ri;
+
+    while ((c = getopt(argc, argv, "n:s:T:")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 's':
+            device = optarg;
+            break;
+        case 'T':
+            arm_trace_file = optarg;           // transfers go to <tracefile>.0
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (iterations <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    nb_modbus_t* nb_ctx = nb_modbus_new_tcp("127.0.0.1", 502);
+    add_arm(nb_ctx, 0, device, 0, NULL);
+    if (nb_ctx->arm[0] == NULL) {
+        printf("Cannot open board %s\n", device);
+        exit(EXIT_FAILURE);
+    }
+
+    for (ri = 0; ri < REQUESTS; ri++) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        for (i = 0; i < iterations; i++) {
+            len = build_req(req, &requests[ri]);
+            nb_modbus_reply(nb_ctx, req, len);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+        double ns = elapsed_ns(&t1, &t2);
+        total += ns;
+        printf("%-16s %10.0f req/s  %7.0f ns/req  (reply fc %02x)\n", requests[ri].name,
+               iterations / ns * 1e9, ns / iterations, req[7]);
+    }
+    printf("%-16s %10.0f req/s\n", "all", REQUESTS * iterations / total * 1e9);
+    nb_modbus_free(nb_ctx);
+    return 0;
+}
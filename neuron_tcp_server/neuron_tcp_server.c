@@ -21,10 +21,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE                         // recvmmsg, sendmmsg
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <signal.h>
 #include <getopt.h>
@@ -33,14 +35,19 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <fcntl.h>
+#include <time.h>
 #include <sys/epoll.h>
 
 #include "armspi.h"
 #include "armpty.h"
+#include "armtrans.h"
 #include "nb_modbus.h"
+#include "nb_limit.h"
+#include "nb_wheel.h"
 
 
 //int verbose = 0;
@@ -53,6 +60,37 @@ int spi_speed[MAX_ARMS] = {0,0,0};
 char* gpio_int[MAX_ARMS] = { "27", "23", "22" };
 char* firmwaredir = "/opt/fw";
 int do_check_fw = 0;
+int uart_port = 0;                          // raw tcp port of /dev/extcomm/0/0, 0 = disabled
+char* gateway_conf = NULL;                  // unit ranges routed to board uarts
+int gateway_timeout = RTU_DEFAULT_TIMEOUT;
+char* latency_conf = NULL;                  // latency targets of polled uarts
+char* scan_conf = NULL;                     // blocks of rtu slaves polled by gateway
+int udp_port = 0;                           // modbus/udp port, 0 = disabled
+int rtu_tcp_port = 0;                       // rtu over tcp port, 0 = disabled
+uint32_t udp_requests = 0;
+uint32_t udp_batches = 0;                   // recvmmsg calls with data
+uint32_t udp_dropped = 0;                   // datagrams not holding one frame
+char* snapshot_conf = NULL;                 // ranges returned by vendor snapshot function
+char* calib_file = NULL;                    // spi timing of boards per soc
+int do_recalibrate = 0;
+uint32_t sched_rounds = 0;                  // rounds of request scheduler
+uint32_t sched_served = 0;
+uint32_t sched_prio = 0;                    // served by priority lane
+int idle_timeout = 0;                       // [s] connection without requests is closed, 0 = never
+int request_timeout = 0;                    // [ms] for rest of request or sending reply, 0 = unlimited
+int max_connections = 0;                    // oldest idle connection is evicted above, 0 = unlimited
+int keepalive_idle = 0;                     // [s] tcp keepalive probes, 0 = system default
+int keepalive_intvl = 10;
+int keepalive_cnt = 3;
+int conn_count = 0;                         // open modbus connections
+int wheel_on = 0;                           // connection timeouts are checked
+uint32_t conn_evicted = 0;
+uint32_t conn_idle_closed = 0;
+uint32_t conn_stall_closed = 0;             // by request timeout
+int conn_paused = 0;                        // connections with reading paused
+uint32_t bp_pool = 0;                       // pauses by empty buffer pool
+uint32_t bp_budget = 0;                     // pauses by buffers held by connection
+uint32_t bp_resumed = 0;
 
 #define MAXEVENTS 64
 
@@ -60,10 +98,18 @@ int do_check_fw = 0;
 
 #define MAX_MB_BUFFER_LEN   MODBUS_TCP_MAX_ADU_LENGTH
 #define MB_BUFFER_COUNT  128;
-#define DEFAULT_POLL_TIMEOUT 20             // milisec
+#define CONN_MAX_BUFFERS  16                // queued requests and replies, reading pauses above
+#define CONN_LOW_BUFFERS  8                 // reading resumes below
+#define DEFAULT_POLL_TIMEOUT 20             // milisec, latency target of polled uarts
+#define MAX_IDLE_TIMEOUT    86400           // [s] timeouts are armed on wheel in [ms] as uint32
+#define MAX_REQUEST_TIMEOUT 3600000         // [ms]
+#define MAX_CONNECTIONS     65536
 
 nb_modbus_t *nb_ctx = NULL;
 int server_socket;
+int efd;
+struct epoll_event* loop_events;            // batch of epoll_wait being handled
+int loop_count = 0;
 
 typedef struct _mb_buffer_t mb_buffer_t;
 
@@ -71,6 +117,9 @@ struct _mb_buffer_t {
     mb_buffer_t* next;
     uint16_t index;
     uint16_t sendindex;
+    uint16_t cost;                          // estimated spi bytes of request
+    uint8_t prio;                           // request goes by priority lane
+    uint8_t held;                           // request was held by rate limits
     int     id;
     uint8_t data[MAX_MB_BUFFER_LEN];
 };
@@ -80,20 +129,53 @@ struct _mb_buffer_t {
 #define ED_SERVER_SOCKET  1
 #define ED_INTERRUPT      2
 #define ED_PTY            3
+#define ED_UART_SERVER    4
+#define ED_UART_SOCKET    5
+#define ED_GATEWAY        6
+#define ED_POLL           7
+#define ED_UDP            8
+#define ED_RTU_SERVER     9
+#define ED_RTU_SOCKET     10              // modbus socket with rtu framing
+#define ED_WHEEL          11              // ticks of connection timeouts
 
 /* user data of event */
-typedef struct {
+typedef struct _mb_event_data_t mb_event_data_t;
+
+struct _mb_event_data_t {
     int fd;
     int type;
     union {
         struct {
           mb_buffer_t* rd_buffer;
           mb_buffer_t* wr_buffer;
+          mb_buffer_t* rq_head;             // complete requests waiting for scheduler
+          mb_buffer_t* rq_tail;
+          mb_event_data_t* sched_prev;      // ring of connections with requests
+          mb_event_data_t* sched_next;
+          mb_event_data_t* prio_prev;       // ring of connections with priority request at head
+          mb_event_data_t* prio_next;
+          int deficit;                      // spi bytes allowed in current round
+          int control;                      // all requests go by priority lane, no limits
+          nb_client* client;                // rate limits of client address
+          nb_timer timer;                   // idle and request timeout
+          uint64_t last_rx;                 // [ms] monotonic
+          uint64_t stall_start;             // [ms] waiting for peer since, 0 = not waiting
+          mb_event_data_t* lru_prev;        // connections by last activity
+          mb_event_data_t* lru_next;
+          int rq_count;                     // requests in rq queue
+          int wr_count;                     // buffers in wr queue
+          int paused;                       // reading paused by backpressure
+          mb_event_data_t* pause_next;
+          mb_buffer_t* gw_buffers;          // request buffers kept for replies from rtu line
         };    
-        arm_handle* arm;
+        struct {
+          arm_handle* arm;
+          uint8_t uart;
+        };
+        rtu_channel* channel;
     };
     
-} mb_event_data_t;
+};
 
 
 mb_buffer_t* b_stack;
@@ -136,6 +218,7 @@ mb_buffer_t* get_from_pool(void)
     b_stack = prev->next;
     prev->index = 0;
     prev->sendindex = 0;
+    prev->held = 0;
     prev->next = NULL;
     return(prev);
 }
@@ -161,6 +244,56 @@ static int make_socket_non_blocking (int sfd)
 }
 
 
+/* Listening socket for raw uart access */
+static int tcp_listen(const char* address, int port)
+{
+    int fd, enable = 1;
+    struct sockaddr_in addr;
+
+    fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1) return -1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1) {
+        close(fd);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(address);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+        (listen(fd, 1) == -1) || (make_socket_non_blocking(fd) == -1)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/* Datagram socket for Modbus/UDP */
+static int udp_listen(const char* address, int port)
+{
+    int fd, enable = 1;
+    struct sockaddr_in addr;
+
+    fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd == -1) return -1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1) {
+        close(fd);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(address);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) ||
+        (make_socket_non_blocking(fd) == -1)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
 static void close_sigint(int dummy)
 {
     close(server_socket);
@@ -170,6 +303,54 @@ static void close_sigint(int dummy)
 }
 
 
+volatile sig_atomic_t do_print_stats = 0;
+
+static void stats_sigusr1(int dummy)
+{
+    do_print_stats = 1;
+}
+
+void print_stats(void)
+{
+    int ai, pi;
+    for (ai=0; ai < MAX_ARMS; ai++) {
+        arm_handle* arm = nb_ctx->arm[ai];
+        if (arm == NULL) continue;
+        printf("Board%d spi speed=%uHz (max %uHz) crc errors=%u rate=%u.%02u%% down=%u up=%u\n",
+               arm->index, arm->speed, arm->max_speed, arm->crc_errors,
+               arm->link_rate / 10000, (arm->link_rate / 100) % 100, arm->speed_down, arm->speed_up);
+        if (arm->mask_writes)
+            printf("Board%d mask writes=%u without read=%u\n", arm->index, arm->mask_writes, arm->mask_cached);
+        armpty_print_stats(arm);
+        if (arm->fdint >= 0) {
+            printf("Board%d interrupts=%u (%s) di=%u rx=%u unknown=%u", arm->index, arm->int_count,
+                   arm->intcdev ? "chardev" : "sysfs", arm->int_di, arm->int_rx, arm->int_unknown);
+            if (arm->int_stamped)
+                printf(" latency avg=%lluus max=%uus", 
+                       (unsigned long long)(arm->int_latency_sum / arm->int_stamped), arm->int_latency_max);
+            printf("\n");
+        }
+        for (pi=0; pi < MAX_UARTS; pi++) {
+            if (arm->uart_q[pi].gateway != NULL)
+                rtu_print_stats(arm->uart_q[pi].gateway);
+        }
+    }
+    if (sched_served)
+        printf("Scheduler rounds=%u served=%u priority=%u\n", sched_rounds, sched_served, sched_prio);
+    if (nb_limit_enabled())
+        nb_limit_print_stats();
+    if (max_connections || wheel_on)
+        printf("Connections open=%d (max %d) evicted=%u idle closed=%u request timeouts=%u\n",
+               conn_count, max_connections, conn_evicted, conn_idle_closed, conn_stall_closed);
+    if (bp_pool || bp_budget)
+        printf("Backpressure paused=%d by pool=%u by budget=%u resumed=%u\n",
+               conn_paused, bp_pool, bp_budget, bp_resumed);
+    if (udp_port > 0)
+        printf("UDP requests=%u batches=%u dropped=%u\n", udp_requests, udp_batches, udp_dropped);
+    fflush(stdout);
+}
+
+
 
 int nb_send(int fd, mb_buffer_t* buffer)
 {
@@ -204,74 +385,788 @@ void debpr(uint8_t* data, int len)
 
 #define RES_WRITE_QUEUE 1
 
+/* Send response or append it to write queue of connection */
+int send_reply(mb_event_data_t* event_data, mb_buffer_t* buffer)
+{
+    if (event_data->type == ED_RTU_SOCKET)
+        buffer->index = nb_modbus_tcp_to_rtu(buffer->data, buffer->index);
+    if (event_data->wr_buffer != NULL) { /* add buffer to write_queue */
+        mb_buffer_t* last = event_data->wr_buffer;
+        while (last->next != NULL) last = last->next;
+        last->next = buffer;
+        event_data->wr_count++;
+        return 0;
+    }
+    /* try to send data */
+    int rc = nb_send(event_data->fd, buffer);
+    if (rc < 0) {                   /* Fatal error */
+        repool_buffer(buffer);
+        return -1;
+    }
+    if (rc > 0) {                   /* Data was sent partially, add EPOLLOUT */
+        event_data->wr_buffer = buffer;
+        event_data->wr_count++;
+        return RES_WRITE_QUEUE;
+    }
+    repool_buffer(buffer);
+    return 0;
+}
+
+/* Connection management. Open connections are kept in list by last
+   activity, the head is evicted first if max_connections is reached.
+   Timeouts are checked lazily: activity only updates time stamps, timer
+   of connection on wheel is moved when it expires before deadline */
+nb_wheel conn_wheel;
+mb_event_data_t* lru_head = NULL;           // least recently active
+mb_event_data_t* lru_tail = NULL;
+
+static uint64_t conn_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void lru_unlink(mb_event_data_t* conn)
+{
+    if ((conn->lru_prev == NULL) && (lru_head != conn)) return;
+    if (conn->lru_prev) conn->lru_prev->lru_next = conn->lru_next;
+    else lru_head = conn->lru_next;
+    if (conn->lru_next) conn->lru_next->lru_prev = conn->lru_prev;
+    else lru_tail = conn->lru_prev;
+    conn->lru_prev = conn->lru_next = NULL;
+    conn_count--;
+}
+
+static void lru_append(mb_event_data_t* conn)
+{
+    conn->lru_prev = lru_tail;
+    conn->lru_next = NULL;
+    if (lru_tail) lru_tail->lru_next = conn;
+    else lru_head = conn;
+    lru_tail = conn;
+    conn_count++;
+}
+
+/* Earliest time connection is to be closed at */
+static uint64_t conn_deadline(mb_event_data_t* conn, uint64_t now, int* stalled)
+{
+    uint64_t deadline = UINT64_MAX;
+    *stalled = 0;
+    if (idle_timeout > 0) {
+        /* queued requests or replies - client is waiting, not idle */
+        deadline = ((conn->rq_head || conn->wr_buffer) ? now : conn->last_rx) + (uint64_t)idle_timeout * 1000;
+    }
+    if ((request_timeout > 0) && conn->stall_start && (conn->stall_start + request_timeout <= deadline)) {
+        deadline = conn->stall_start + request_timeout;
+        *stalled = 1;
+    }
+    return deadline;
+}
+
+static void conn_arm(mb_event_data_t* conn, uint64_t now)
+{
+    int stalled;
+    uint64_t deadline = conn_deadline(conn, now, &stalled);
+    if (deadline != UINT64_MAX)
+        nb_timer_add(&conn_wheel, &conn->timer, (deadline > now) ? deadline - now : 0);
+}
+
+/* Stall starts when connection waits for rest of request or for room to send reply.
+   Data in rd_buffer of connection paused by backpressure waits for us, not for peer */
+static void conn_stall(mb_event_data_t* conn, uint64_t now)
+{
+    if ((conn->paused || !(conn->rd_buffer && conn->rd_buffer->index)) && (conn->wr_buffer == NULL)) {
+        conn->stall_start = 0;
+    } else if (conn->stall_start == 0) {
+        conn->stall_start = now;
+        if (wheel_on && (request_timeout > 0)) conn_arm(conn, now);
+    }
+}
+
+/* Data received on connection */
+static void conn_activity(mb_event_data_t* conn)
+{
+    uint64_t now = conn_now_ms();
+    conn->last_rx = now;
+    if (conn != lru_tail) {
+        lru_unlink(conn);
+        lru_append(conn);
+    }
+    conn_stall(conn, now);
+}
+
+static void set_keepalive(int fd)
+{
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive_idle, sizeof(keepalive_idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive_intvl, sizeof(keepalive_intvl));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepalive_cnt, sizeof(keepalive_cnt));
+}
+
+/* Events of connection by its state. Modifying the set re-checks readiness,
+   so data that came while reading was paused is reported again */
+static void conn_rearm(mb_event_data_t* conn)
+{
+    struct epoll_event event;
+    event.events = EPOLLET | (conn->paused ? 0 : EPOLLIN) | (conn->wr_buffer ? EPOLLOUT : 0);
+    event.data.ptr = conn;
+    if (epoll_ctl (efd, EPOLL_CTL_MOD, conn->fd, &event) == -1)
+        perror ("epoll_ctl");
+}
+
+/* Backpressure - connection is not read until buffers are back,
+   clients see full tcp window instead of lost requests */
+mb_event_data_t* paused_list = NULL;
+
+static void conn_pause(mb_event_data_t* conn, int by_pool)
+{
+    if (conn->paused) return;
+    conn->paused = 1;
+    conn->pause_next = paused_list;
+    paused_list = conn;
+    conn_paused++;
+    if (by_pool) bp_pool++;
+    else bp_budget++;
+    conn_rearm(conn);
+}
+
+static void conn_unpause(mb_event_data_t* conn)
+{
+    mb_event_data_t** pp = &paused_list;
+    if (!conn->paused) return;
+    while (*pp != NULL) {
+        if (*pp == conn) {
+            *pp = conn->pause_next;
+            break;
+        }
+        pp = &(*pp)->pause_next;
+    }
+    conn->pause_next = NULL;
+    conn->paused = 0;
+    conn_paused--;
+}
+
+#define conn_over_budget(c) ((c)->rq_count + (c)->wr_count >= CONN_MAX_BUFFERS)
+
+void wait_for_write(mb_event_data_t* event_data)
+{
+    conn_rearm(event_data);
+    conn_stall(event_data, conn_now_ms());
+}
+
+/* Request scheduler. Complete requests wait in queue of their connection,
+   connections with requests are served by deficit round robin weighted by
+   estimated spi bytes, so a client polling large blocks cannot hold off
+   the others. Writes and all requests of control clients go by priority
+   lane, served before every visit of next connection. */
+#define SCHED_QUANTUM        256            // spi bytes credited to connection per round
+#define MAX_CONTROL_CLIENTS  8
+
+in_addr_t control_clients[MAX_CONTROL_CLIENTS];
+int control_count = 0;
+mb_event_data_t* sched_ring = NULL;         // connection visited next
+int sched_active = 0;                       // connections in ring
+mb_event_data_t* prio_ring = NULL;          // priority lane, connection served next
+int prio_active = 0;
+
+static void sched_link(mb_event_data_t* conn)
+{
+    if (sched_ring == NULL) {
+        conn->sched_prev = conn->sched_next = conn;
+        sched_ring = conn;
+    } else {                                /* behind all waiting connections */
+        conn->sched_next = sched_ring;
+        conn->sched_prev = sched_ring->sched_prev;
+        sched_ring->sched_prev->sched_next = conn;
+        sched_ring->sched_prev = conn;
+    }
+    sched_active++;
+}
+
+static void sched_unlink(mb_event_data_t* conn)
+{
+    if (conn->sched_next == NULL) return;
+    if (conn->sched_next == conn) {
+        sched_ring = NULL;
+    } else {
+        conn->sched_prev->sched_next = conn->sched_next;
+        conn->sched_next->sched_prev = conn->sched_prev;
+        if (sched_ring == conn) sched_ring = conn->sched_next;
+    }
+    conn->sched_next = conn->sched_prev = NULL;
+    sched_active--;
+}
+
+static void prio_unlink(mb_event_data_t* conn)
+{
+    if (conn->prio_next == NULL) return;
+    if (conn->prio_next == conn) {
+        prio_ring = NULL;
+    } else {
+        conn->prio_prev->prio_next = conn->prio_next;
+        conn->prio_next->prio_prev = conn->prio_prev;
+        if (prio_ring == conn) prio_ring = conn->prio_next;
+    }
+    conn->prio_next = conn->prio_prev = NULL;
+    prio_active--;
+}
+
+/* Connection is in priority lane while request at head of its queue has prio */
+static void prio_update(mb_event_data_t* conn)
+{
+    if ((conn->rq_head == NULL) || !conn->rq_head->prio) {
+        prio_unlink(conn);
+    } else if (conn->prio_next == NULL) {
+        if (prio_ring == NULL) {
+            conn->prio_prev = conn->prio_next = conn;
+            prio_ring = conn;
+        } else {
+            conn->prio_next = prio_ring;
+            conn->prio_prev = prio_ring->prio_prev;
+            prio_ring->prio_prev->prio_next = conn;
+            prio_ring->prio_prev = conn;
+        }
+        prio_active++;
+    }
+}
+
+/* Append complete request to queue of connection */
+static void sched_enqueue(mb_event_data_t* conn, mb_buffer_t* buffer)
+{
+    int cost = nb_modbus_cost(nb_ctx, buffer->data, buffer->index);
+    buffer->prio = (cost < 0) || conn->control;
+    buffer->cost = (cost < 0) ? -cost : cost;
+    buffer->next = NULL;
+    if (conn->rq_head == NULL) {
+        conn->rq_head = buffer;
+        sched_link(conn);
+        prio_update(conn);
+    } else {
+        conn->rq_tail->next = buffer;
+    }
+    conn->rq_tail = buffer;
+    conn->rq_count++;
+}
+
+/* Split received data to requests and pass them to scheduler */
 int parse_buffer(mb_event_data_t* event_data)
 {
     /* There can be more than one request in buffer */
-    int result = 0;
-
     while (1) {
         mb_buffer_t* buffer = event_data->rd_buffer;
         if (buffer == NULL) return 0;
 
-        int reqlen = nb_modbus_reqlen(buffer->data, buffer->index);
+        int reqlen;
+        if (event_data->type == ED_RTU_SOCKET) {
+            reqlen = nb_modbus_rtu_reqlen(buffer->data, buffer->index);
+            if (reqlen < 0) {
+                /* unknown function or oversized frame, frame end cannot be found - drop all */
+                event_data->rd_buffer = NULL;
+                repool_buffer(buffer);
+                return 0;
+            }
+        } else {
+            reqlen = nb_modbus_reqlen(buffer->data, buffer->index);
+        }
 
         //printf("req len = %d\n", reqlen);
         //debpr( buffer->data, buffer->index);
 
-        if (reqlen == 0) return result;
+        if (reqlen == 0) return 0;
         if (reqlen > MAX_MB_BUFFER_LEN) return -1;   /* bad length in packet header*/
 
         if (reqlen < buffer->index) {
             /* copy oversized data to new buffer */
             mb_buffer_t* new_buf = get_from_pool();
-            if (new_buf == NULL)  return -1;
+            if (new_buf == NULL) {
+                /* requests stay in rd_buffer until pool has buffers */
+                conn_pause(event_data, 1);
+                return 0;
+            }
             new_buf->index = buffer->index-reqlen;
             memmove(new_buf->data, buffer->data+reqlen,new_buf->index);
             event_data->rd_buffer = new_buf;
         } else {
             event_data->rd_buffer = NULL;
         }
-        buffer->index = nb_modbus_reply(nb_ctx, buffer->data, reqlen);
-        if ( buffer->index > 0) {
-            //printf("wr len = %d\n", buffer->index);
-            //debpr( buffer->data, buffer->index);
-            if (event_data->wr_buffer != NULL) { /* add buffer to write_queue */
-                mb_buffer_t* last = event_data->wr_buffer;
-                while (last->next != NULL) last = last->next;
-                last->next = buffer;
- 
-           } else {                             /* try to send data */
-                int rc = nb_send(event_data->fd, buffer);
-                if (rc < 0) {                   /* Fatal error */
-                    repool_buffer(buffer);
-                    return -1;
-                }
-                if (rc > 0) {                   /* Data was sent partially, add EPOLLOUT */
-                    struct epoll_event event;
-                    event_data->wr_buffer = buffer;
-                    result = RES_WRITE_QUEUE;
-                }
+        if (event_data->type == ED_RTU_SOCKET) {
+            reqlen = nb_modbus_rtu_to_tcp(buffer->data, reqlen);
+            if (reqlen < 0) {                  /* bad crc - no reply as on rtu line */
                 repool_buffer(buffer);
+                continue;
             }
-        } else {
-            repool_buffer(buffer);
         }
+        buffer->index = reqlen;
+        sched_enqueue(event_data, buffer);
     } /* while */
 }
 
+/* Modbus/UDP - every datagram carries one MBAP frame, reply goes back
+   to its sender. Datagrams are received and replies sent in batches,
+   one batch per event - socket is level triggered, the rest comes in
+   next loop after other sockets were served */
+#define UDP_BATCH 16
+
+/* Datagram over rate limit cannot wait in queue, it gets cached or busy response.
+   Returns length of response, 0 if request is to be served */
+static int udp_limit(uint32_t addr, uint8_t* req, int len)
+{
+    nb_client* client = NULL;
+    int board = nb_modbus_board(nb_ctx, req, len);
+    int cost = nb_modbus_cost(nb_ctx, req, len);
+    int action = NB_LIMIT_BUSY, rsp_length = 0, i;
+
+    for (i = 0; i < control_count; i++) {
+        if (addr == control_clients[i]) break;
+    }
+    if (i == control_count) client = nb_client_get(addr);
+    if (nb_limit_take(client, board, (cost < 0) ? -cost : cost, cost < 0) > 0) {
+        if (limit_action == NB_LIMIT_CACHE)
+            rsp_length = nb_cache_reply(nb_cache_key(req, len), req);
+        if (rsp_length > 0)
+            action = NB_LIMIT_CACHE;
+        else
+            rsp_length = nb_modbus_exception(nb_ctx, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY, req);
+        nb_limit_count(client, board, action);
+    }
+    nb_client_put(client);
+    return rsp_length;
+}
+
+void udp_serve(int fd)
+{
+    static uint8_t data[UDP_BATCH][MAX_MB_BUFFER_LEN];
+    static struct sockaddr_in addr[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH], rsps[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH], rsp_iovs[UDP_BATCH];
+    int i, n, nrsp;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < UDP_BATCH; i++) {
+        iovs[i].iov_base = data[i];
+        iovs[i].iov_len = MAX_MB_BUFFER_LEN;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addr[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+    }
+    n = recvmmsg(fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n <= 0) return;
+    udp_batches++;
+
+    memset(rsps, 0, sizeof(rsps));
+    for (i = 0, nrsp = 0; i < n; i++) {
+        int len = msgs[i].msg_len;
+        if ((len < _MODBUS_TCP_HEADER_LENGTH + 1) || (nb_modbus_reqlen(data[i], len) != len)) {
+            udp_dropped++;                 // incomplete or more frames in datagram
+            continue;
+        }
+        udp_requests++;
+        if (nb_limit_enabled()) {
+            uint64_t key = (limit_action == NB_LIMIT_CACHE) ? nb_cache_key(data[i], len) : 0;
+            int rsp_length = udp_limit(addr[i].sin_addr.s_addr, data[i], len);
+            if (rsp_length > 0) {
+                len = rsp_length;
+            } else {
+                len = nb_modbus_reply(nb_ctx, data[i], len);
+                if (len > 0) nb_cache_store(key, data[i], len);
+            }
+        } else {
+            len = nb_modbus_reply(nb_ctx, data[i], len);
+        }
+        if (len <= 0) continue;
+        rsp_iovs[nrsp].iov_base = data[i];
+        rsp_iovs[nrsp].iov_len = len;
+        rsps[nrsp].msg_hdr.msg_iov = &rsp_iovs[nrsp];
+        rsps[nrsp].msg_hdr.msg_iovlen = 1;
+        rsps[nrsp].msg_hdr.msg_name = &addr[i];
+        rsps[nrsp].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+        nrsp++;
+    }
+    if (nrsp > 0) sendmmsg(fd, rsps, nrsp, MSG_DONTWAIT);
+}
+
+/* Response from downstream rtu slave */
+void gateway_reply(void* owner, uint8_t* rsp, int rsp_length)
+{
+    mb_event_data_t* event_data = owner;
+    mb_buffer_t* buffer = event_data->gw_buffers;
+    if (buffer == NULL) return;
+    event_data->gw_buffers = buffer->next;
+    buffer->next = NULL;
+    memcpy(buffer->data, rsp, rsp_length);
+    buffer->index = rsp_length;
+    int rc = send_reply(event_data, buffer);
+    if (rc == RES_WRITE_QUEUE) wait_for_write(event_data);
+    /* reply can come while scheduler walks connections,
+       connection is closed by HUP event in main loop */
+    if (rc < 0) shutdown(event_data->fd, SHUT_RDWR);
+}
+
+void gateway_cancel(mb_event_data_t* event_data)
+{
+    int unit;
+    for (unit=MAX_ARMS+1; unit<256; unit++) {
+        if (nb_ctx->gateway[unit] != NULL) 
+            rtu_cancel(nb_ctx->gateway[unit], event_data);
+    }
+}
+
+/* Parse list of unit-unit:board/uart[@baud] and create rtu lines */
+int gateway_create(char* conf)
+{
+    char* p = conf;
+    while (p != NULL && *p) {
+        int first, last, board, uart, baud = RTU_DEFAULT_BAUD;
+        int n = sscanf(p, "%d-%d:%d/%d@%d", &first, &last, &board, &uart, &baud);
+        if (n < 4) return -1;
+        if ((first <= MAX_ARMS) || (last > 255) || (first > last) ||
+            (board < 1) || (board > MAX_ARMS) || (uart < 0) || (uart >= MAX_UARTS)) return -1;
+        arm_handle* arm = nb_ctx->arm[board-1];
+        if ((arm == NULL) || (uart >= arm->bv.uart_count)) {
+            printf("Gateway: board %d has no uart %d\n", board, uart);
+        } else {
+            rtu_channel* channel = arm->uart_q[uart].gateway;
+            if (channel == NULL) {
+                channel = rtu_channel_new(arm, uart, baud, gateway_timeout, gateway_reply);
+                if (channel == NULL) return -1;
+                armpty_setbaud(arm, uart, baud);
+                armpty_enable_int(arm);
+            }
+            for (n=first; n<=last; n++) nb_ctx->gateway[n] = channel;
+            if (verbose) printf("Gateway: units %d-%d on board %d uart %d (%d Bd)\n", first, last, board, uart, baud);
+        }
+        p = strchr(p, ',');
+        if (p) p++;
+    }
+    return 0;
+}
+
+/* Parse list of unit:fc:addr:count[@period] and add blocks to scan lists */
+int scan_create(char* conf)
+{
+    char* p = conf;
+    while (p != NULL && *p) {
+        int unit, fc, addr, count, period = RTU_DEFAULT_PERIOD;
+        int n = sscanf(p, "%d:%d:%d:%d@%d", &unit, &fc, &addr, &count, &period);
+        if (n < 4) return -1;
+        if ((unit <= MAX_ARMS) || (unit > 255) || (addr < 0) || (addr > 65535) ||
+            (count <= 0) || (count > 2000) || (period <= 0)) return -1;
+        if (nb_ctx->gateway[unit] == NULL) {
+            printf("Scan: unit %d is not routed to gateway\n", unit);
+        } else {
+            if (rtu_poll_add(nb_ctx->gateway[unit], unit, fc, addr, count, period) < 0) return -1;
+            if (verbose) printf("Scan: unit %d fc %d addr %d count %d every %dms\n", unit, fc, addr, count, period);
+        }
+        p = strchr(p, ',');
+        if (p) p++;
+    }
+    return 0;
+}
+
+/* Assign latency targets [ms] to uarts in order of boards,
+   the last one given is used for the rest */
+void latency_apply(char* conf, int latency)
+{
+    char* p = conf;
+    int ai, pi;
+    for (ai=0; ai < MAX_ARMS; ai++) {
+        arm_handle* arm = nb_ctx->arm[ai];
+        if (arm == NULL) continue;
+        for (pi=0; (pi < arm->bv.uart_count) && (pi < MAX_UARTS); pi++) {
+            if ((p != NULL) && *p) {
+                if (atoi(p) > 0) latency = atoi(p);
+                p = strchr(p, ',');
+                if (p) p++;
+            }
+            arm->uart_q[pi].latency = latency * 1000;
+        }
+    }
+}
+
+/* Spi timing from calibration file, boards not found there are calibrated now */
+void calibrate_arm(arm_handle* arm)
+{
+    if (!do_recalibrate && arm_load_timing(arm, calib_file)) {
+        if (verbose) printf("Board%d timing chunk=%d delay=%dus\n", arm->index, arm->chunk, arm->phase_delay);
+        return;
+    }
+    if (arm_calibrate(arm) < 0) {
+        printf("Board%d calibration failed, default timing used\n", arm->index);
+        return;
+    }
+    if (arm_save_timing(arm, calib_file) < 0)
+        perror("Cannot save calibration");
+}
+
+/* Pty and raw tcp client of uart are level triggered, they are not
+   polled for input while the board does not take chars from txbuf */
+mb_event_data_t* uart_inputs[MAX_ARMS][MAX_UARTS][2];  // pty, raw tcp client
+
+void uart_tx_wait(arm_handle* arm, uint8_t uart, int wait)
+{
+    int k;
+    for (k = 0; k < 2; k++) {
+        mb_event_data_t* input = uart_inputs[arm->index][uart][k];
+        struct epoll_event event;
+        if (input == NULL) continue;
+        if (input->type == ED_PTY)
+            event.events = EPOLLPRI | EPOLLHUP | (wait ? 0 : EPOLLIN);
+        else
+            event.events = wait ? 0 : (EPOLLIN | EPOLLRDHUP);
+        event.data.ptr = input;
+        if (epoll_ctl(efd, EPOLL_CTL_MOD, input->fd, &event) == -1)
+            perror("epoll_ctl");
+    }
+}
+
+/* Raw uart client has gone, return uart back to pty */
+void close_uart_socket(mb_event_data_t* event_data)
+{
+    arm_handle* arm = event_data->arm;
+    arm->uart_q[event_data->uart].sockfd = -1;
+    uart_inputs[arm->index][event_data->uart][1] = NULL;
+    if (verbose) printf("Closed uart connection on descriptor %d\n", event_data->fd);
+    close(event_data->fd);
+    free(event_data);
+}
+
 /* Close fd, return buffers do pool, free data */
 void close_event(mb_event_data_t* event_data)
 {
+    int i;
+    gateway_cancel(event_data);
     if (event_data->rd_buffer)
         repool_buffer(event_data->rd_buffer);
     if (event_data->wr_buffer)
         repool_buffer(event_data->wr_buffer);
+    if (event_data->rq_head)
+        repool_buffer(event_data->rq_head);
+    if (event_data->gw_buffers)
+        repool_buffer(event_data->gw_buffers);
+    sched_unlink(event_data);
+    prio_unlink(event_data);
+    nb_client_put(event_data->client);
+    lru_unlink(event_data);
+    conn_unpause(event_data);
+    if (wheel_on) nb_timer_del(&conn_wheel, &event_data->timer);
+    /* connection can be closed by other event (timeout, eviction) */
+    for (i = 0; i < loop_count; i++) {
+        if (loop_events[i].data.ptr == event_data) loop_events[i].data.ptr = NULL;
+    }
     /* Closing the descriptor will make epoll remove it
        from the set of descriptors which are monitored. */
     close(event_data->fd);
     free(event_data);
 }
 
+/* Timer of connection expired, close it or move timer to new deadline */
+static void conn_expire(nb_timer* timer)
+{
+    mb_event_data_t* conn = (mb_event_data_t*)((char*)timer - offsetof(mb_event_data_t, timer));
+    uint64_t now = conn_now_ms();
+    int stalled;
+
+    conn_stall(conn, now);
+    if (conn_deadline(conn, now, &stalled) > now) {
+        conn_arm(conn, now);
+        return;
+    }
+    if (stalled) conn_stall_closed++;
+    else conn_idle_closed++;
+    printf("Connection on descriptor %d timed out (%s)\n", conn->fd, stalled ? "request" : "idle");
+    close_event(conn);
+}
+
+/* Make room for new connection */
+static int conn_evict(void)
+{
+    mb_event_data_t* conn = lru_head;
+    if (conn == NULL) return -1;
+    printf("Connection on descriptor %d evicted\n", conn->fd);
+    conn_evicted++;
+    close_event(conn);
+    return 0;
+}
+
+/* Paused connections are resumed when the pool has buffers again and
+   their queues are drained. Returns 1 if some connection was resumed */
+int conn_resume(void)
+{
+    mb_event_data_t* conn = paused_list;
+    int resumed = 0;
+
+    paused_list = NULL;
+    while (conn != NULL) {
+        mb_event_data_t* next = conn->pause_next;
+        if ((b_stack == NULL) || (conn->rq_count + conn->wr_count >= CONN_LOW_BUFFERS)) {
+            conn->pause_next = paused_list;         /* keep waiting */
+            paused_list = conn;
+        } else {
+            conn->pause_next = NULL;
+            conn->paused = 0;
+            conn_paused--;
+            bp_resumed++;
+            resumed = 1;
+            /* complete requests can wait in rd_buffer, the rest is on socket */
+            if (parse_buffer(conn) < 0) close_event(conn);
+            else if (!conn->paused) conn_rearm(conn);
+        }
+        conn = next;
+    }
+    return resumed;
+}
+
+/* Request over rate limit is held in queue (returns [ms] to wait) or
+   answered without spi (returns -1, response in buffer). Returns 0 to serve it */
+static int sched_limit(mb_event_data_t* conn, mb_buffer_t* buffer)
+{
+    nb_client* client = conn->control ? NULL : conn->client;
+    int board = nb_modbus_board(nb_ctx, buffer->data, buffer->index);
+    int wait = nb_limit_take(client, board, buffer->cost, buffer->prio);
+    int action = limit_action;
+    int len = 0;
+
+    if (wait == 0) return 0;
+    if (action == NB_LIMIT_CACHE) {
+        len = nb_cache_reply(nb_cache_key(buffer->data, buffer->index), buffer->data);
+        if (len == 0) action = NB_LIMIT_DELAY;         // writes and reads not seen yet
+    } else if (action == NB_LIMIT_BUSY) {
+        len = nb_modbus_exception(nb_ctx, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY, buffer->data);
+    }
+    if (!buffer->held) nb_limit_count(client, buffer->prio ? -1 : board, action);
+    buffer->held = 1;
+    if (len == 0) return wait;
+    buffer->index = len;
+    return -1;
+}
+
+int sched_hold;                             // [ms] until first held request may go, 0 = none
+int sched_progress;                         // request was served in this run
+
+/* Serve first request in queue of connection. Returns -1 if connection
+   was closed, [ms] to wait if request is held by rate limits, else 0 */
+static int sched_serve(mb_event_data_t* conn)
+{
+    mb_buffer_t* buffer = conn->rq_head;
+    uint64_t key = 0;
+    int len = 0, rc = 0;
+
+    if (nb_limit_enabled()) {
+        len = sched_limit(conn, buffer);
+        if (len > 0) {
+            if ((sched_hold == 0) || (len < sched_hold)) sched_hold = len;
+            return len;
+        }
+        if ((len == 0) && (limit_action == NB_LIMIT_CACHE))
+            key = nb_cache_key(buffer->data, buffer->index);
+    }
+    conn->rq_head = buffer->next;
+    buffer->next = NULL;
+    conn->rq_count--;
+    conn->deficit -= buffer->cost;
+    if (conn->rq_head == NULL) {
+        sched_unlink(conn);
+        if (conn->deficit > 0) conn->deficit = 0;
+    }
+    prio_update(conn);
+    sched_served++;
+    sched_progress = 1;
+    if (len < 0) {
+        len = buffer->index;                /* answered by limits */
+    } else {
+        /* request buffer is kept for reply which comes from downstream rtu line later */
+        buffer->next = conn->gw_buffers;
+        conn->gw_buffers = buffer;
+        if (nb_modbus_gateway(nb_ctx, conn, buffer->data, buffer->index))
+            return 0;
+        conn->gw_buffers = buffer->next;
+        buffer->next = NULL;
+        len = nb_modbus_reply(nb_ctx, buffer->data, buffer->index);
+        if (key && (len > 0)) nb_cache_store(key, buffer->data, len);
+    }
+    if (len > 0) {
+        //printf("wr len = %d\n", len);
+        //debpr( buffer->data, len);
+        buffer->index = len;
+        rc = send_reply(conn, buffer);
+    } else {
+        repool_buffer(buffer);
+    }
+    if (rc < 0) {
+        close_event(conn);
+        return -1;
+    }
+    if (rc == RES_WRITE_QUEUE) wait_for_write(conn);
+    return 0;
+}
+
+/* Priority requests at head of queues. Only connections in priority lane
+   are visited, connection with held request stays there for next pass */
+static void sched_priority_lane(void)
+{
+    int n = prio_active;
+
+    while ((n-- > 0) && (prio_ring != NULL)) {
+        mb_event_data_t* conn = prio_ring;
+        prio_ring = conn->prio_next;
+        while ((conn->rq_head != NULL) && conn->rq_head->prio) {
+            sched_prio++;
+            if (sched_serve(conn) != 0) break;
+        }
+    }
+}
+
+/* One round of deficit round robin over connections with requests.
+   Sockets are read again between rounds. Returns timeout for epoll_wait:
+   -1 if no request waits, [ms] if all waiting requests are held by limits */
+int sched_run(void)
+{
+    int n = sched_active;
+
+    if (n == 0) return -1;
+    sched_rounds++;
+    sched_hold = 0;
+    sched_progress = 0;
+    while ((n-- > 0) && (sched_ring != NULL)) {
+        sched_priority_lane();
+        mb_event_data_t* conn = sched_ring;
+        if (conn == NULL) break;
+        sched_ring = conn->sched_next;
+        conn->deficit += SCHED_QUANTUM;
+        while ((conn->rq_head != NULL) && (conn->rq_head->cost <= conn->deficit)) {
+            int rc = sched_serve(conn);
+            if (rc < 0) break;
+            if (rc > 0) {                   /* held, no credit saved up meanwhile */
+                if (conn->deficit > conn->rq_head->cost) conn->deficit = conn->rq_head->cost;
+                break;
+            }
+        }
+    }
+    if (sched_active == 0) return -1;
+    return (!sched_progress && sched_hold) ? sched_hold : 0;
+}
+
+/* Parse list of client addresses served by priority lane */
+int control_create(char* conf)
+{
+    char* p = conf;
+    while (p != NULL && *p) {
+        char addr[INET_ADDRSTRLEN];
+        int len = strcspn(p, ",");
+        if ((len >= INET_ADDRSTRLEN) || (control_count >= MAX_CONTROL_CLIENTS)) return -1;
+        memcpy(addr, p, len);
+        addr[len] = '\0';
+        if (inet_pton(AF_INET, addr, &control_clients[control_count]) != 1) return -1;
+        control_count++;
+        p = strchr(p, ',');
+        if (p) p++;
+    }
+    return 0;
+}
+
 
 static struct option long_options[] = {
   {"verbose", no_argument,       0, 'v'},
@@ -285,12 +1180,30 @@ static struct option long_options[] = {
   {"bauds",required_argument, 0, 'b'},
   {"fwdir", required_argument, 0, 'f'},
   {"check-firmware", no_argument,0, 'c'},
+  {"uartqueue", required_argument, 0, 'q'},
+  {"uartport", required_argument, 0, 'u'},
+  {"gateway", required_argument, 0, 'g'},
+  {"gwtimeout", required_argument, 0, 'w'},
+  {"scan", required_argument, 0, 'S'},
+  {"latency", required_argument, 0, 'L'},
+  {"trace", required_argument, 0, 'T'},
+  {"calibration", required_argument, 0, 'C'},
+  {"recalibrate", no_argument, 0, 'R'},
+  {"snapshot", required_argument, 0, 'X'},
+  {"udp", required_argument, 0, 'U'},
+  {"rtuport", required_argument, 0, 'r'},
+  {"control", required_argument, 0, 'K'},
+  {"limit", required_argument, 0, 'Q'},
+  {"idletimeout", required_argument, 0, 'I'},
+  {"reqtimeout", required_argument, 0, 'e'},
+  {"maxconn", required_argument, 0, 'm'},
+  {"keepalive", required_argument, 0, 'k'},
   {0, 0, 0, 0}
 };
 
 static void print_usage(const char *progname)
 {
-  printf("usage: %s [-v[v]] [-d] [-l listen_address] [-p port] [-s dev1[,dev2[,dev3]]] [-i gpio1[,gpio2[,gpio3]]] [-b [baud1,..] [-f firmwaredir] [-c]\n", progname);
+  printf("usage: %s [-v[v]] [-d] [-l listen_address] [-p port] [-s dev1[,dev2[,dev3]]] (dev: /dev/spidevX.Y, sim[:hw], unix:path) [-i [gpiochipN:]gpio1[,gpio2[,gpio3]]] [-b [baud1,..] [-f firmwaredir] [-c] [-q uart_queue_len] [-u uart_tcp_port] [-g unit-unit:board/uart[@baud][,..]] [-w gateway_timeout] [-S unit:fc:addr:count[@ms][,..]] [-L ms[,ms..]] [-T tracefile] [-C calibfile [-R]] [-X r|b<addr>:<count>[,..]] [-U udp_port] [-r rtu_over_tcp_port] [-K control_ip[,..]] [-Q client_rps:client_bps[:board_bps[:delay|cache|busy]]] [-I idle_s] [-e request_ms] [-m max_conns] [-k idle_s[:intvl_s[:count]]]\n", progname);
   int i;
   for (i=0; ; i++) {
       if (long_options[i].name == NULL)  return;
@@ -360,7 +1273,6 @@ int main(int argc, char *argv[])
     int daemon = 0;
     int server_socket;
     int s, nss;
-    int efd;
     struct epoll_event event;
     struct epoll_event *events;
     mb_event_data_t*  event_data;
@@ -369,7 +1281,7 @@ int main(int argc, char *argv[])
     int c;
     while (1) {
        int option_index = 0;
-       c = getopt_long(argc, argv, "vdcl:p:t:s:b:i:f:n:", long_options, &option_index);
+       c = getopt_long(argc, argv, "vdcl:p:t:s:b:i:f:n:q:u:g:w:S:L:T:C:RX:U:r:K:Q:I:e:m:k:", long_options, &option_index);
        if (c == -1) {
            if (optind < argc)  {
                printf ("non-option ARGV-element: %s\n", argv[optind]);
@@ -436,6 +1348,102 @@ int main(int argc, char *argv[])
        case 'c':
            do_check_fw = 1;
            break;
+       case 'u':
+           uart_port = atoi(optarg);
+           if (uart_port==0) {
+               printf("Uart port must be non-zero integer (given %s)\n", optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'g':
+           gateway_conf = strdup(optarg);
+           break;
+       case 'w':
+           gateway_timeout = atoi(optarg);
+           if (gateway_timeout<=0) {
+               printf("Gateway timeout must be non-zero integer (given %s)\n", optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'S':
+           scan_conf = strdup(optarg);
+           break;
+       case 'L':
+           latency_conf = strdup(optarg);
+           break;
+       case 'T':
+           arm_trace_file = strdup(optarg);
+           break;
+       case 'C':
+           calib_file = strdup(optarg);
+           break;
+       case 'R':
+           do_recalibrate = 1;
+           break;
+       case 'X':
+           snapshot_conf = strdup(optarg);
+           break;
+       case 'r':
+           rtu_tcp_port = atoi(optarg);
+           if (rtu_tcp_port <= 0) {
+               printf("Rtu port must be non-zero integer (given %s)\n", optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'K':
+           if (control_create(optarg) < 0) {
+               printf("Invalid control clients %s (max %d addresses)\n", optarg, MAX_CONTROL_CLIENTS);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'Q':
+           if (nb_limit_parse(optarg) < 0) {
+               printf("Invalid rate limits %s\n", optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'I':
+           idle_timeout = atoi(optarg);
+           if ((idle_timeout <= 0) || (idle_timeout > MAX_IDLE_TIMEOUT)) {
+               printf("Idle timeout must be 1..%d s (given %s)\n", MAX_IDLE_TIMEOUT, optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'e':
+           request_timeout = atoi(optarg);
+           if ((request_timeout <= 0) || (request_timeout > MAX_REQUEST_TIMEOUT)) {
+               printf("Request timeout must be 1..%d ms (given %s)\n", MAX_REQUEST_TIMEOUT, optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'm':
+           max_connections = atoi(optarg);
+           if ((max_connections <= 0) || (max_connections > MAX_CONNECTIONS)) {
+               printf("Max connections must be 1..%d (given %s)\n", MAX_CONNECTIONS, optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'k':
+           if ((sscanf(optarg, "%d:%d:%d", &keepalive_idle, &keepalive_intvl, &keepalive_cnt) < 1) ||
+               (keepalive_idle <= 0) || (keepalive_intvl <= 0) || (keepalive_cnt <= 0)) {
+               printf("Keepalive must be idle[:interval[:count]] in seconds (given %s)\n", optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'U':
+           udp_port = atoi(optarg);
+           if (udp_port <= 0) {
+               printf("Udp port must be non-zero integer (given %s)\n", optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
+       case 'q':
+           uart_queue_len = atoi(optarg);
+           if ((uart_queue_len < 256) || (uart_queue_len > 65536)) {
+               printf("Uart queue length must be 256..65536 (given %s)\n", optarg);
+               exit(EXIT_FAILURE);
+           }
+           break;
        default:
            print_usage(argv[0]);
            exit(EXIT_FAILURE);
@@ -445,6 +1453,7 @@ int main(int argc, char *argv[])
 
 
     nb_ctx = nb_modbus_new_tcp(listen_address, tcp_port);
+    armpty_tx_hook = uart_tx_wait;
     nb_ctx->fwdir = firmwaredir;
     server_socket = modbus_tcp_listen(nb_ctx->ctx, NB_CONNECTION);
     if (server_socket == -1) {
@@ -453,6 +1462,7 @@ int main(int argc, char *argv[])
     }
 
     signal(SIGINT, close_sigint);
+    signal(SIGUSR1, stats_sigusr1);
     s = make_socket_non_blocking (server_socket);
     if (s == -1)  abort ();
 
@@ -468,9 +1478,26 @@ int main(int argc, char *argv[])
             add_arm(nb_ctx, ai, dev, speed, gpio_int[ai]);
             if (nb_ctx->arm[ai] && do_check_fw)
                 arm_firmware(nb_ctx->arm[ai], firmwaredir, FALSE);
+            if (nb_ctx->arm[ai] && calib_file)
+                calibrate_arm(nb_ctx->arm[ai]);
         }
     }
 
+    if ((gateway_conf != NULL) && (gateway_create(gateway_conf) < 0)) {
+        printf("Bad gateway configuration (%s)\n", gateway_conf);
+        exit(EXIT_FAILURE);
+    }
+    if ((scan_conf != NULL) && (scan_create(scan_conf) < 0)) {
+        printf("Bad scan configuration (%s)\n", scan_conf);
+        exit(EXIT_FAILURE);
+    }
+    if ((snapshot_conf != NULL) && (nb_modbus_snapshot(nb_ctx, snapshot_conf) < 0)) {
+        printf("Bad snapshot configuration (%s)\n", snapshot_conf);
+        exit(EXIT_FAILURE);
+    }
+    if (poll_timeout <= 0) poll_timeout = DEFAULT_POLL_TIMEOUT;
+    latency_apply(latency_conf, poll_timeout);
+
     /* Prepare epoll structure, insert server_socket to epoll */
     efd = epoll_create1 (0);
     if (efd == -1) {
@@ -488,6 +1515,51 @@ int main(int argc, char *argv[])
         abort ();
     }
 
+    if (rtu_tcp_port > 0) {
+        int rfd = tcp_listen(listen_address, rtu_tcp_port);
+        if (rfd < 0) {
+            perror("rtu tcp listen");
+        } else {
+            if (verbose) printf("Modbus RTU over tcp on port %d\n", rtu_tcp_port);
+            event_data = calloc(1, sizeof(mb_event_data_t));
+            event_data->fd = rfd;
+            event_data->type = ED_RTU_SERVER;
+            event.events = EPOLLIN | EPOLLET;
+            event.data.ptr = event_data;
+            s = epoll_ctl (efd, EPOLL_CTL_ADD, rfd, &event);
+        }
+    }
+
+    if ((idle_timeout > 0) || (request_timeout > 0)) {
+        int wfd = nb_wheel_init(&conn_wheel);
+        if (wfd < 0) {
+            perror("timer wheel");
+        } else {
+            wheel_on = 1;
+            event_data = calloc(1, sizeof(mb_event_data_t));
+            event_data->fd = wfd;
+            event_data->type = ED_WHEEL;
+            event.events = EPOLLIN;
+            event.data.ptr = event_data;
+            s = epoll_ctl (efd, EPOLL_CTL_ADD, wfd, &event);
+        }
+    }
+
+    if (udp_port > 0) {
+        int ufd = udp_listen(listen_address, udp_port);
+        if (ufd < 0) {
+            perror("udp listen");
+        } else {
+            if (verbose) printf("Modbus/UDP on port %d\n", udp_port);
+            event_data = calloc(1, sizeof(mb_event_data_t));
+            event_data->fd = ufd;
+            event_data->type = ED_UDP;
+            event.events = EPOLLIN;
+            event.data.ptr = event_data;
+            s = epoll_ctl (efd, EPOLL_CTL_ADD, ufd, &event);
+        }
+    }
+
     /* Insert board interrupt sockets to epoll */
     int fdint;
     for (ai=0; ai < MAX_ARMS; ai++) {
@@ -499,33 +1571,73 @@ int main(int argc, char *argv[])
             event_data->fd = fdint;
             event_data->type = ED_INTERRUPT;
             event_data->arm = arm;
-            event.events = EPOLLPRI;// | EPOLLET;
+            /* line event fd is readable, sysfs value file signals priority data */
+            event.events = arm->intcdev ? EPOLLIN : EPOLLPRI;
             event.data.ptr = event_data;
             s = epoll_ctl(efd, EPOLL_CTL_ADD, fdint, &event);
-        } else {
-            if (poll_timeout == 0) {
-                poll_timeout = DEFAULT_POLL_TIMEOUT;
-            }
+            /* inputs are cached from now, changes come by interrupt */
+            armpty_enable_int(arm);
+            arm_refresh_di(arm);
+        }
+        if ((arm->bv.uart_count > 0) && (armpty_poll_open(arm) >= 0)) {
+            /* no interrupt - uarts are polled by adaptive timer,
+               else the timer retries chars not taken by board */
+            event_data = calloc(1, sizeof(mb_event_data_t));
+            event_data->fd = arm->polltimer;
+            event_data->type = ED_POLL;
+            event_data->arm = arm;
+            event.events = EPOLLIN;
+            event.data.ptr = event_data;
+            s = epoll_ctl(efd, EPOLL_CTL_ADD, arm->polltimer, &event);
         }
-        /* ----- ToDo more Uarts */
         int pi, pty;
         //printf ("uarts = %d\n", arm->uart_count);
-        for (pi=0; pi < arm->bv.uart_count; pi++) {
+        for (pi=0; (pi < arm->bv.uart_count) && (pi < MAX_UARTS); pi++) {
+            rtu_channel* channel = arm->uart_q[pi].gateway;
+            if (channel != NULL) {
+                /* uart is used by gateway only */
+                event_data = calloc(1, sizeof(mb_event_data_t));
+                event_data->fd = channel->timerfd;
+                event_data->type = ED_GATEWAY;
+                event_data->channel = channel;
+                event.events = EPOLLIN;
+                event.data.ptr = event_data;
+                s = epoll_ctl (efd, EPOLL_CTL_ADD, channel->timerfd, &event);
+                continue;
+            }
             pty = armpty_open(arm, pi);
             if (pty >= 0) {
                 event_data = calloc(1, sizeof(mb_event_data_t));
                 event_data->fd = pty;
                 event_data->type = ED_PTY;
                 event_data->arm = arm;
+                event_data->uart = pi;
                 event.events =  EPOLLPRI | EPOLLIN | EPOLLHUP;// | EPOLLET;
                 event.data.ptr = event_data;
                 s = epoll_ctl (efd, EPOLL_CTL_ADD, pty, &event);
+                uart_inputs[ai][pi][0] = event_data;
             }
+            if ((uart_port == 0) || (arm->uart_q[pi].line < 0)) continue;
+            /* raw tcp port serving the same uart as /dev/extcomm/0/x */
+            int port = uart_port + arm->uart_q[pi].line;
+            int ufd = tcp_listen(listen_address, port);
+            if (ufd < 0) {
+                perror("uart tcp listen");
+                continue;
+            }
+            if (verbose) printf("Board%d UART%d on tcp port %d\n", arm->index, pi, port);
+            event_data = calloc(1, sizeof(mb_event_data_t));
+            event_data->fd = ufd;
+            event_data->type = ED_UART_SERVER;
+            event_data->arm = arm;
+            event_data->uart = pi;
+            event.events = EPOLLIN;
+            event.data.ptr = event_data;
+            s = epoll_ctl (efd, EPOLL_CTL_ADD, ufd, &event);
         }
     }
 
-    if (poll_timeout == 0) poll_timeout = -1; 
-    if (verbose) printf ("poll timeout = %d[ms]\n", poll_timeout);
+    if (verbose) printf ("uart latency target = %d[ms]\n", poll_timeout);
     /* Prepare buffer pool */
     pool_allocate();
 
@@ -551,27 +1663,41 @@ int main(int argc, char *argv[])
 
     if (verbose) printf("Starting loop\n");
     /* The event loop */
+    int timeout = -1;                       // requests waiting in scheduler poll sockets only
     while (1) {
 
         if (deferred_op == DFR_OP_FIRMWARE) {
             deferred_op = DFR_NONE;
             arm_firmware(deferred_arm, firmwaredir, FALSE);
         }
+        if (do_print_stats) {
+            do_print_stats = 0;
+            print_stats();
+        }
 
         int n, i;
-        n = epoll_wait (efd, events, MAXEVENTS, poll_timeout);
+        n = epoll_wait (efd, events, MAXEVENTS, timeout);
+        loop_events = events;
+        loop_count = (n > 0) ? n : 0;
         for (i = 0; i < n; i++) {
             event_data = events[i].data.ptr;
+            if (event_data == NULL) continue;
             /* ..  Check Interrupts .. */
             if (event_data->type == ED_INTERRUPT) {
                 if (verbose>1) printf("INT on arm%d\n", event_data->arm->index);
-                if ((events[i].events & EPOLLPRI) && (event_data->arm != NULL)) {
-                    uint16_t intval;
-                    fdint = event_data->fd;
-                    pread(fdint, &intval, 2, 0); // read 2 bytes value of gpio - should be 1
-                    //printf("INT on arm%d : %04x\n", event_data->arm->index, intval);
-                    //if ((intval & 0xff) == 0x31)
-                    armpty_readuart(event_data->arm, 1);
+                if ((events[i].events & (EPOLLPRI | EPOLLIN)) && (event_data->arm != NULL)) {
+                    arm_handle* arm = event_data->arm;
+                    if (arm_read_int(arm) > 0) {
+                        int status = arm_int_status(arm);
+                        uart_queue* queue = &arm->uart_q[0];
+                        /* firmware without cause bits - inputs and uarts as before */
+                        if ((status & ARM_INT_DI_CHANGED) || !(status & ARM_INT_MASK))
+                            arm_refresh_di(arm);
+                        /* status op can bring the first char of uart 0 */
+                        if ((status & ARM_INT_RX) || !(status & ARM_INT_MASK) ||
+                            uq_used(queue) || queue->remain)
+                            armpty_readuart(arm, 0);
+                    }
                 }
                 continue;
             }
@@ -579,22 +1705,79 @@ int main(int argc, char *argv[])
             if (event_data->type == ED_PTY) {
                 if (event_data->arm == NULL) continue;
                 if ((events[i].events & EPOLLPRI)) {
-                    armpty_setuart(event_data->fd, event_data->arm, 0/*event_data->uart*/);
+                    armpty_setuart(event_data->fd, event_data->arm, event_data->uart);
                     //continue;
                 }
                 if ((events[i].events & EPOLLIN)) {
-                    armpty_readpty(event_data->fd, event_data->arm, 0/*event_data->uart*/);
+                    armpty_readpty(event_data->fd, event_data->arm, event_data->uart);
                     //continue;
                 }
                 if ((events[i].events & EPOLLHUP)) {
-                    printf("HUP on PTY arm%d : %c\n", event_data->arm->index);
+                    printf("HUP on PTY arm%d : %d\n", event_data->arm->index, event_data->uart);
+                }
+                continue;
+            }
+
+            if (event_data->type == ED_POLL) {
+                armpty_poll(event_data->arm);
+                continue;
+            }
+
+            if (event_data->type == ED_UDP) {
+                udp_serve(event_data->fd);
+                continue;
+            }
+
+            if (event_data->type == ED_WHEEL) {
+                nb_wheel_tick(&conn_wheel);
+                continue;
+            }
+
+            if (event_data->type == ED_GATEWAY) {
+                rtu_timer(event_data->channel);
+                continue;
+            }
+
+            if (event_data->type == ED_UART_SERVER) {
+                uart_queue* queue = &event_data->arm->uart_q[event_data->uart];
+                int newfd = accept(event_data->fd, NULL, NULL);
+                if (newfd == -1) continue;
+                if ((queue->sockfd != -1) || (make_socket_non_blocking(newfd) == -1)) {
+                    close(newfd);                  // only one client per uart
+                    continue;
+                }
+                int enable = 1;
+                setsockopt(newfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+                mb_event_data_t* uart_data = calloc(1, sizeof(mb_event_data_t));
+                uart_data->fd = newfd;
+                uart_data->type = ED_UART_SOCKET;
+                uart_data->arm = event_data->arm;
+                uart_data->uart = event_data->uart;
+                event.events = queue->txwait ? 0 : (EPOLLIN | EPOLLRDHUP);
+                event.data.ptr = uart_data;
+                if (epoll_ctl (efd, EPOLL_CTL_ADD, newfd, &event) == -1) {
+                    perror ("epoll_ctl");
+                    close(newfd);
+                    free(uart_data);
+                    continue;
+                }
+                if (verbose) printf("New uart connection on socket %d\n", newfd);
+                queue->sockfd = newfd;
+                uart_inputs[event_data->arm->index][event_data->uart][1] = uart_data;
+                continue;
+            }
+
+            if (event_data->type == ED_UART_SOCKET) {
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+                    (armpty_readsock(event_data->fd, event_data->arm, event_data->uart) < 0)) {
+                    close_uart_socket(event_data);
                 }
                 continue;
             }
 
             if ((events[i].events & EPOLLERR) ||
                 (events[i].events & EPOLLHUP) ||
-                (!(events[i].events & EPOLLIN))) {
+                (!(events[i].events & (EPOLLIN | EPOLLOUT)))) {
                 /* An error has occured on this fd, or the socket is not
                    ready for reading (why were we notified then?) */
                 if (events[i].events & EPOLLERR) fprintf (stderr, "epoll ERR error\n");
@@ -606,7 +1789,7 @@ int main(int argc, char *argv[])
             }
 
             /* Check listening socket */
-            if (event_data->type == ED_SERVER_SOCKET) {
+            if ((event_data->type == ED_SERVER_SOCKET) || (event_data->type == ED_RTU_SERVER)) {
                 /* We have a notification on the listening socket, which
                    means one or more incoming connections. */
                 while (1)  {
@@ -617,7 +1800,7 @@ int main(int argc, char *argv[])
                     /* Handle new connections */
                     addrlen = sizeof(clientaddr);
                     memset(&clientaddr, 0, sizeof(clientaddr));
-                    newfd = accept(server_socket, (struct sockaddr *)&clientaddr, &addrlen);
+                    newfd = accept(event_data->fd, (struct sockaddr *)&clientaddr, &addrlen);
                     if (newfd == -1) {
                         if (!((errno == EAGAIN) || (errno == EWOULDBLOCK)))
                             perror("Server accept() error");
@@ -633,45 +1816,61 @@ int main(int argc, char *argv[])
                         continue;
                     }
 
-                    event_data = calloc(1, sizeof(mb_event_data_t));
-                    event_data->fd = newfd;
-                    event_data->type = ED_MODBUS_SOCKET;
-                    event.data.ptr = event_data;
+                    if ((max_connections > 0) && (conn_count >= max_connections) && (conn_evict() < 0)) {
+                        close(newfd);
+                        continue;
+                    }
+                    if (keepalive_idle > 0) set_keepalive(newfd);
+
+                    mb_event_data_t* conn_data = calloc(1, sizeof(mb_event_data_t));
+                    conn_data->fd = newfd;
+                    conn_data->type = (event_data->type == ED_RTU_SERVER) ? ED_RTU_SOCKET : ED_MODBUS_SOCKET;
+                    conn_data->timer.expire = conn_expire;
+                    conn_data->last_rx = conn_now_ms();
+                    lru_append(conn_data);
+                    if (wheel_on) conn_arm(conn_data, conn_data->last_rx);
+                    for (s = 0; s < control_count; s++) {
+                        if (clientaddr.sin_addr.s_addr == control_clients[s]) conn_data->control = 1;
+                    }
+                    if (!conn_data->control && nb_limit_enabled())
+                        conn_data->client = nb_client_get(clientaddr.sin_addr.s_addr);
+                    event.data.ptr = conn_data;
                     event.events = EPOLLIN | EPOLLET;
                     s = epoll_ctl (efd, EPOLL_CTL_ADD, newfd, &event);
                     if (s == -1) {
                         perror ("epoll_ctl");
-                        close_event(event_data);
+                        close_event(conn_data);
                     }
                 }
                 continue;
             }
 
-            if (events[i].events & EPOLLOUT) {
+            if ((events[i].events & EPOLLOUT) && (event_data->wr_buffer != NULL)) {
                 mb_buffer_t* buffer;
                 while (1) {
                     /* try to send data */
                     int rc = nb_send(event_data->fd, event_data->wr_buffer);
                     if (rc < 0) { /* Fatalni error */
                         close_event(event_data);
+                        event_data = NULL;
                         break;  // continue on next socket
                     }
                     if (rc == 0) { /* All data from buffer was sent */
                         buffer = event_data->wr_buffer;
-                        event_data->wr_buffer == buffer->next;
+                        event_data->wr_buffer = buffer->next;
+                        event_data->wr_count--;
                         buffer->next = NULL;
                         repool_buffer(buffer);
                         if (event_data->wr_buffer == NULL) {
-                            event.events =  EPOLLIN | EPOLLET;
-                            s = epoll_ctl (efd, EPOLL_CTL_MOD, event_data->fd, &event);
-                            if (s == -1)  perror ("epoll_ctl");
+                            conn_rearm(event_data);
+                            conn_stall(event_data, conn_now_ms());
                             break;
                         }
                     } else break;
                 }
             }
 
-            if (events[i].events & EPOLLIN) {
+            if ((event_data != NULL) && (events[i].events & EPOLLIN)) {
 
                 /* We have data on the fd waiting to be read.
                    We must read whatever data is available completely,
@@ -681,9 +1880,17 @@ int main(int argc, char *argv[])
                     ssize_t count;
                     int rc;
 
+                    if (conn_over_budget(event_data)) {
+                        conn_pause(event_data, 0);
+                        break;
+                    }
                     if (event_data->rd_buffer == NULL) {
                         event_data->rd_buffer = get_from_pool();
-                        if (event_data->rd_buffer == NULL) break;  // ToDo - cteni neprobehne a epoll znovu neprijde!
+                        if (event_data->rd_buffer == NULL) {
+                            /* edge triggered - reading is re-armed by conn_resume */
+                            conn_pause(event_data, 1);
+                            break;
+                        }
                     }
                     int wanted = MAX_MB_BUFFER_LEN - event_data->rd_buffer->index;
                     count = read(event_data->fd,
@@ -714,12 +1921,8 @@ int main(int argc, char *argv[])
                         close_event(event_data);
                         break;
                     } 
-                    if (rc == RES_WRITE_QUEUE) {
-                        event.events =  EPOLLIN | EPOLLOUT | EPOLLET;
-                        event.data.ptr =  event_data;
-                        if (epoll_ctl (efd, EPOLL_CTL_MOD, event_data->fd, &event) == -1) 
-                            perror ("epoll_ctl");
-                    }
+                    conn_activity(event_data);
+                    if (event_data->paused) break;
 
                     //if (count < 0) break; // socket is closed due to error
                     if (count < wanted) break; //?? je to spravne ??
@@ -727,15 +1930,8 @@ int main(int argc, char *argv[])
             } /* if EPOLLIN */
             /* End of one event */
         }
-        if (poll_timeout > 0) {
-          for (ai=0; ai < MAX_ARMS; ai++) {
-            arm_handle* arm = nb_ctx->arm[ai];
-            if (arm == NULL) continue;
-            if ((arm->bv.int_mask_register <= 0) && (arm->bv.uart_count>0)) {
-                if (verbose > 2) printf("readpty..\n");
-                armpty_readuart(arm, 1);
-            }
-          }
-        }
+        loop_count = 0;
+        timeout = sched_run();
+        if ((paused_list != NULL) && conn_resume()) timeout = 0;
     }
 }
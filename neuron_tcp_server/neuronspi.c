@@ -22,6 +22,7 @@
 #include <sys/mman.h>
 
 #include "armspi.h"
+#include "armtrans.h"
 
 
 //#define FILEMODE S_IRWXU | S_IRGRP | S_IROTH
@@ -122,7 +123,7 @@ int main(int argc, char *argv[])
     //printf("cnt =%d  %5x \n",n, buffer[0]);
     */
 
-    close(arm->fd);
+    arm_transport_close(arm);
     return 0;
 }
 